@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "host.h"
+
+// The kernel is built into this file so its internals can be timed one by one
+#include "../src/miros.c"
+
+// Kernel microbenchmarks. Each primitive is run BENCH_SAMPLES times with a
+// number of other threads sleeping in the release queue, and the distribution
+// of its cost is written as CSV lines: benchmark, threads, samples, unit, min,
+// median, p99 and max. The unit is the host timestamp counter, or nanoseconds.
+//   tick           os_tick(), the tick interrupt, when no thread is released
+//   schedule       A pass of os_schedule() that keeps the current thread
+//   enqueue        os_enqueue_aperiodic_task()
+//   semaphore      semaphore_signal() then semaphore_wait() without blocking
+//   signal_switch  From semaphore_signal() to the woken thread running
+//   wait_switch    From semaphore_wait() blocking to the next thread running
+
+#if !defined(BENCH_SAMPLES)
+	#define BENCH_SAMPLES 10000
+#endif
+
+// Time stamp counter, or nanoseconds where there is none
+#if defined(__x86_64__) || defined(__i386__)
+	#define BENCH_UNIT "tsc"
+	static inline uint64_t bench_timestamp(void) {
+		return __builtin_ia32_rdtsc();
+	}
+#else
+	#define BENCH_UNIT "ns"
+	static inline uint64_t bench_timestamp(void) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return now.tv_sec * 1000000000ull + now.tv_nsec;
+	}
+#endif
+
+static uint64_t bench_samples[BENCH_SAMPLES];
+static uint64_t bench_overhead; // Of reading the timestamp twice
+static uint32_t bench_threads;
+
+static int bench_compare(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+static void bench_report(const char* name) {
+	for (uint32_t i = 0; i < BENCH_SAMPLES; i++)
+		bench_samples[i] = bench_samples[i] > bench_overhead ? bench_samples[i] - bench_overhead : 0;
+	qsort(bench_samples, BENCH_SAMPLES, sizeof(bench_samples[0]), bench_compare);
+	printf("%s,%u,%u,%s,%llu,%llu,%llu,%llu\n", name, bench_threads, BENCH_SAMPLES, BENCH_UNIT,
+		(unsigned long long) bench_samples[0],
+		(unsigned long long) bench_samples[BENCH_SAMPLES / 2],
+		(unsigned long long) bench_samples[BENCH_SAMPLES * 99 / 100],
+		(unsigned long long) bench_samples[BENCH_SAMPLES - 1]);
+}
+
+static void bench_overhead_measure(void) {
+	uint64_t minimum = UINT64_MAX;
+	for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+		uint64_t start = bench_timestamp();
+		uint64_t elapsed = bench_timestamp() - start;
+		if (elapsed < minimum)
+			minimum = elapsed;
+	}
+	bench_overhead = minimum;
+}
+
+/*
+ * Threads
+ */
+static void bench_sleeper_main(void) {
+}
+
+static void bench_aperiodic(aperiodic_task_t* aperiodic_task) {
+	(void) aperiodic_task;
+}
+
+// Waits on bench_ping with a shorter deadline than the bench thread, so every
+// signal switches to it, and every wait switches back
+static semaphore_t bench_ping;
+static uint64_t bench_switch_start;
+static uint64_t bench_switch_end;
+static thread_t bench_partner_thread;
+static void bench_partner_main(void) {
+	while (true) {
+		bench_switch_start = bench_timestamp();
+		semaphore_wait(&bench_ping);
+		bench_switch_end = bench_timestamp();
+	}
+}
+
+static thread_t bench_thread;
+static void bench_main(void) {
+	for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+		uint64_t start = bench_timestamp();
+		os_tick();
+		bench_samples[i] = bench_timestamp() - start;
+	}
+	bench_report("tick");
+
+	for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+		port_critical_t critical = port_enter_critical();
+		uint64_t start = bench_timestamp();
+		os_schedule();
+		bench_samples[i] = bench_timestamp() - start;
+		port_exit_critical(critical);
+	}
+	bench_report("schedule");
+
+	// Keep the queue from filling up by emptying it behind the server's back
+	for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+		uint64_t start = bench_timestamp();
+		bool enqueued = os_enqueue_aperiodic_task(&bench_aperiodic, 1);
+		bench_samples[i] = bench_timestamp() - start;
+		OS_ASSERT(enqueued);
+		os_aperiodic_queue_pop();
+	}
+	bench_report("enqueue");
+
+	semaphore_t semaphore;
+	semaphore_init(&semaphore, 1, 0);
+	for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+		uint64_t start = bench_timestamp();
+		semaphore_signal(&semaphore);
+		semaphore_wait(&semaphore);
+		bench_samples[i] = bench_timestamp() - start;
+	}
+	bench_report("semaphore");
+
+	static uint64_t wait_samples[BENCH_SAMPLES];
+	for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+		uint64_t start = bench_timestamp();
+		semaphore_signal(&bench_ping);
+		uint64_t end = bench_timestamp();
+		bench_samples[i] = bench_switch_end - start;
+		wait_samples[i] = end - bench_switch_start;
+	}
+	bench_report("signal_switch");
+	for (uint32_t i = 0; i < BENCH_SAMPLES; i++)
+		bench_samples[i] = wait_samples[i];
+	bench_report("wait_switch");
+
+	host_stop();
+}
+
+static void bench_run(uint32_t threads) {
+	os_init(OS_SERVER_BANDWIDTH(1, 3));
+	bench_threads = threads;
+
+	// The sleepers run once, then wait for a release that never comes
+	static thread_t sleepers[OS_MAX_THREADS];
+	for (uint32_t i = 0; i < threads; i++) {
+		sleepers[i] = (thread_t) {
+			.entry_point = &bench_sleeper_main,
+			.relative_deadline = OS_MILLIS(1 + i),
+			.period = UINT32_MAX - i,
+		};
+		os_add_thread(&sleepers[i]);
+	}
+
+	semaphore_init(&bench_ping, 1, 0);
+	bench_partner_thread = (thread_t) {
+		.entry_point = &bench_partner_main,
+		.relative_deadline = UINT32_MAX - 2,
+		.period = UINT32_MAX,
+	};
+	os_add_thread(&bench_partner_thread);
+	bench_thread = (thread_t) {
+		.entry_point = &bench_main,
+		.relative_deadline = UINT32_MAX - 1,
+		.period = UINT32_MAX,
+	};
+	os_add_thread(&bench_thread);
+
+	host_run(UINT32_MAX);
+}
+
+int main(void) {
+	bench_overhead_measure();
+	fprintf(stderr, "timer overhead of %llu %s subtracted\n", (unsigned long long) bench_overhead, BENCH_UNIT);
+	printf("benchmark,threads,samples,unit,min,median,p99,max\n");
+	// Besides the sleepers there are the idle, server, partner and bench threads
+	static const uint32_t counts[] = {0, 1, 2, 4, 8, 16, OS_MAX_THREADS - 4};
+	for (uint32_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+		bench_run(counts[i]);
+	return 0;
+}
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "miros.h"
+#include "serial.h"
+#include "sim_hal.h"
+#include "std.h"
+#include "VL53L0X.h"
+
+// Counts what the drivers cost on the simulated peripherals: bring-up of the
+// VL53L0X with and without saved calibration, then the demonstrator's control
+// cycle of reading a range, writing the PWM and printing telemetry. Results are
+// "name value" lines. Given a file of "name limit" lines, the exit status is 1
+// if any result exceeds its limit.
+
+#define DRIVERS_CYCLES 100
+
+static struct VL53L0X sensor = {.io_2v8 = true, .address = VL53L0X_DEFAULT_ADDRESS, .io_timeout = 500};
+
+static struct {
+	const char* name;
+	double value;
+} results[32];
+static unsigned results_count;
+
+static void result(const char* name, double value) {
+	results[results_count].name = name;
+	results[results_count].value = value;
+	results_count++;
+	printf("%s %.2f\n", name, value);
+}
+
+static void result_counters(const char* prefix, const sim_counters_t* before, double count) {
+	static char names[32][64];
+	const sim_counters_t* after = &sim_counters;
+	struct {
+		const char* name;
+		double value;
+	} deltas[] = {
+		{"i2c_transfers", after->i2c_transfers - before->i2c_transfers},
+		{"i2c_bytes", (after->i2c_bytes_written + after->i2c_bytes_read) - (before->i2c_bytes_written + before->i2c_bytes_read)},
+		{"i2c_wire_us", after->i2c_wire_micros - before->i2c_wire_micros},
+		{"serial_bytes", after->serial_bytes - before->serial_bytes},
+		{"serial_dropped", after->serial_dropped - before->serial_dropped},
+		{"pwm_writes", after->pwm_writes - before->pwm_writes},
+	};
+	for (unsigned i = 0; i < sizeof(deltas) / sizeof(deltas[0]); i++) {
+		char* name = names[results_count];
+		snprintf(name, sizeof(names[0]), "%s.%s", prefix, deltas[i].name);
+		result(name, deltas[i].value / count);
+	}
+}
+
+static void sample(void) {
+	// GPIO1 goes low, as if a measurement was over
+	if (sim_vl53l0x_measure(0))
+		VL53L0X_dataReady(&sensor);
+}
+
+static uint32_t cycles;
+static void control(void) {
+	uint16_t range = VL53L0X_waitRangeMillimeters(&sensor);
+	uint8_t duty_cycle = range < 500 ? 31 : 91;
+	hal_pwm_write(duty_cycle);
+	std_printf("%d %d\n", range, duty_cycle);
+	cycles++;
+}
+
+static bool check(const char* path) {
+	FILE* file = fopen(path, "r");
+	if (file == NULL) {
+		perror(path);
+		return false;
+	}
+	bool ok = true;
+	char name[64];
+	double limit;
+	while (fscanf(file, "%63s %lf", name, &limit) == 2) {
+		for (unsigned i = 0; i < results_count; i++) {
+			if (strcmp(results[i].name, name) == 0 && results[i].value > limit) {
+				fprintf(stderr, "%s: %.2f over %.2f\n", name, results[i].value, limit);
+				ok = false;
+			}
+		}
+	}
+	fclose(file);
+	return ok;
+}
+
+int main(int argc, char** argv) {
+	os_init(OS_SERVER_BANDWIDTH(1, 3));
+	sim_reset();
+	sim_vl53l0x_attach(NULL, 0);
+	sim_vl53l0x_set_range(0, 420);
+	serial_init(115200);
+	bus_init();
+
+	// Bring-up, measuring the reference calibration and then reusing it
+	sim_counters_t before = sim_counters;
+	OS_ASSERT(VL53L0X_init(&sensor));
+	result_counters("init", &before, 1);
+	OS_ASSERT(VL53L0X_saveCalibration(&sensor, 1));
+
+	struct VL53L0X_calibration calibration;
+	OS_ASSERT(VL53L0X_loadCalibration(0, &calibration));
+	before = sim_counters;
+	OS_ASSERT(VL53L0X_initCalibrated(&sensor, &calibration));
+	result_counters("init_calibrated", &before, 1);
+
+	VL53L0X_setMeasurementTimingBudget(&sensor, 20e3);
+	VL53L0X_startContinuous(&sensor, 0);
+
+	// Control cycles
+	static thread_t sample_thread = {
+		.entry_point = &sample,
+		.relative_deadline = OS_MILLIS(1),
+		.period = OS_MILLIS(20),
+	};
+	OS_ASSERT(os_add_thread(&sample_thread));
+	static thread_t control_thread = {
+		.entry_point = &control,
+		.relative_deadline = OS_MILLIS(50),
+		.period = OS_MILLIS(50),
+	};
+	OS_ASSERT(os_add_thread(&control_thread));
+
+	before = sim_counters;
+	cycles = 0;
+	host_run(OS_MILLIS(50) * DRIVERS_CYCLES);
+	result_counters("cycle", &before, cycles);
+
+	if (argc > 1 && !check(argv[1]))
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "miros.h"
+
+// The host port runs the kernel as a Linux process, with each thread in its own
+// ucontext. Time is virtual: it only moves forward, one tick at a time, while a
+// thread waits for it in os_burn() or the idle thread runs, so a run takes as
+// little real time as possible and always schedules the same way.
+
+// Core clock the virtual time is counted in, as seen by port_clock()
+#if !defined(HOST_CLOCK_HZ)
+	#define HOST_CLOCK_HZ 72000000
+#endif
+
+// Start the kernel set up with os_init() and os_add_thread(), and return once
+// it has run for the given number of ticks. The kernel can then be set up and
+// run again.
+void host_run(os_time_t ticks);
+// End the run early, from a thread
+void host_stop(void);
+
+// Called from every tick interrupt before the kernel's, as a peripheral
+// interrupt that fired during the tick that is ending would be
+extern void (*host_tick_hook)(void);
+
+// Virtual core clock cycles since the start of the current run
+uint64_t host_cycles(void);
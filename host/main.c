@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "host.h"
+#include "miros.h"
+
+// The demonstrator's threads on the host: the sensor, controller and actuator
+// pipeline hand values over with semaphores and burn their computation time,
+// while a button thread keeps the TBS busy with aperiodic requests.
+
+static semaphore_t measure_occupied_semaphore, measure_available_semaphore;
+static semaphore_t actuator_occupied_semaphore, actuator_available_semaphore;
+
+static thread_t sensor_thread;
+static void sensor_main(void) {
+	semaphore_wait(&measure_available_semaphore);
+	os_burn(OS_MILLIS(1));
+	semaphore_signal(&measure_occupied_semaphore);
+}
+
+static thread_t controller_thread;
+static void controller_main(void) {
+	semaphore_wait(&measure_occupied_semaphore);
+	semaphore_wait(&actuator_available_semaphore);
+	os_burn(OS_MILLIS(2));
+	semaphore_signal(&actuator_occupied_semaphore);
+	semaphore_signal(&measure_available_semaphore);
+}
+
+static thread_t actuator_thread;
+static void actuator_main(void) {
+	semaphore_wait(&actuator_occupied_semaphore);
+	os_burn(OS_MILLIS(1));
+	semaphore_signal(&actuator_available_semaphore);
+}
+
+static void change_main(aperiodic_task_t* change) {
+	(void) change;
+	os_burn(OS_MILLIS(10));
+}
+
+static thread_t button_thread;
+static void button_main(void) {
+	os_enqueue_aperiodic_task(&change_main, OS_MILLIS(10));
+}
+
+int main(void) {
+	// The actuator waits for the controller, which admission control does not
+	// know about, so keep the server's deadlines clear of the controller's
+	os_init(OS_SERVER_BANDWIDTH(1, 3));
+
+	semaphore_init(&measure_available_semaphore, 1, 1);
+	semaphore_init(&measure_occupied_semaphore, 1, 0);
+	semaphore_init(&actuator_available_semaphore, 1, 1);
+	semaphore_init(&actuator_occupied_semaphore, 1, 0);
+
+	sensor_thread = (thread_t) {
+		.entry_point = &sensor_main,
+		.computation_time = OS_MILLIS(1),
+		.relative_deadline = OS_MILLIS(2),
+		.period = OS_MILLIS(50),
+	};
+	OS_ASSERT(os_add_thread(&sensor_thread));
+
+	controller_thread = (thread_t) {
+		.entry_point = &controller_main,
+		.computation_time = OS_MILLIS(2),
+		.relative_deadline = OS_MILLIS(25),
+		.period = OS_MILLIS(50),
+	};
+	OS_ASSERT(os_add_thread(&controller_thread));
+
+	actuator_thread = (thread_t) {
+		.entry_point = &actuator_main,
+		.computation_time = OS_MILLIS(1),
+		.relative_deadline = OS_MILLIS(5),
+		.period = OS_MILLIS(50),
+	};
+	OS_ASSERT(os_add_thread(&actuator_thread));
+
+	button_thread = (thread_t) {
+		.entry_point = &button_main,
+		.relative_deadline = OS_MILLIS(1),
+		.period = OS_MILLIS(500),
+	};
+	OS_ASSERT(os_add_thread(&button_thread));
+
+	os_time_t ticks = OS_SECONDS(60);
+	clock_t start = clock();
+	host_run(ticks);
+	double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+	printf("%llu ticks in %.3f s (%.0f ticks/s)\n", (unsigned long long) ticks, seconds, ticks / seconds);
+
+	#if defined(OS_STATS)
+		const thread_t* threads[] = {&sensor_thread, &controller_thread, &actuator_thread, &button_thread};
+		printf("id jobs misses max_response_us max_jitter_us\n");
+		for (unsigned i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+			os_thread_stats_t stats;
+			os_get_stats(threads[i], &stats);
+			printf("%u %u %u %u %u\n", threads[i]->id, stats.jobs, stats.deadline_misses, stats.max_response_micros, stats.max_release_jitter_micros);
+		}
+	#endif
+	return 0;
+}
@@ -0,0 +1,256 @@
+#include "port.h"
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ucontext.h>
+
+#include "host.h"
+
+#if defined(OS_TICKLESS)
+	#error "the host port always ticks, it has no tickless mode"
+#endif
+
+// Size of each thread's host stack, the one given to the kernel is not used
+#if !defined(HOST_STACK_SIZE)
+	#define HOST_STACK_SIZE (64 * 1024)
+#endif
+
+static struct {
+	ucontext_t context;
+	jmp_buf restart; // At the top of the thread's stack, see port_thread_restart()
+	void* stack;
+} host_threads[OS_MAX_THREADS];
+
+// Context of host_run(), while the kernel runs
+static ucontext_t host_main_context;
+static jmp_buf host_exit;
+
+// Critical sections are a flag, and so is a pending switch, which is carried
+// out when the outermost critical section is left as PendSV would be
+static bool host_irq_disabled;
+static bool host_switch_pending;
+
+// Virtual time
+static uint64_t host_cycle_count;
+static uint32_t host_tick_cycles;
+static os_time_t host_ticks;
+static os_time_t host_ticks_end;
+
+void (*host_tick_hook)(void);
+
+#if defined(OS_TRACE)
+	// The trace records are dropped, but completing the transfer is deferred to
+	// the next tick as it would be by DMA
+	static bool host_trace_sending;
+#endif
+
+/*
+ * Interrupts
+ */
+static void host_switch(void) {
+	host_irq_disabled = true;
+	thread_t* previous = os_thread_current;
+	os_thread_switch();
+	if (os_thread_current != previous) {
+		ucontext_t* context = previous != NULL ? &host_threads[previous->id].context : &host_main_context;
+		swapcontext(context, &host_threads[os_thread_current->id].context);
+		// host_run() only gets switched back to when the run is over
+		if (previous == NULL)
+			longjmp(host_exit, 1);
+	}
+	host_irq_disabled = false;
+}
+
+port_critical_t port_enter_critical(void) {
+	port_critical_t previous = host_irq_disabled;
+	host_irq_disabled = true;
+	return previous;
+}
+
+void port_exit_critical(port_critical_t previous) {
+	host_irq_disabled = previous;
+	while (!host_irq_disabled && host_switch_pending) {
+		host_switch_pending = false;
+		host_switch();
+	}
+}
+
+/*
+ * Atomics
+ */
+// Interrupts only come in at the tick, so a compare and swap with the value
+// loaded behaves as the exclusive monitor would
+static uint32_t host_exclusive_value;
+
+uint32_t port_load_exclusive(volatile uint32_t* address) {
+	return host_exclusive_value = __atomic_load_n(address, __ATOMIC_SEQ_CST);
+}
+
+bool port_store_exclusive(volatile uint32_t* address, uint32_t value) {
+	uint32_t expected = host_exclusive_value;
+	return __atomic_compare_exchange_n(address, &expected, value, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+void port_clear_exclusive(void) {
+}
+
+void port_memory_barrier(void) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * Threads
+ */
+void port_init(void) {
+	host_irq_disabled = false;
+	host_switch_pending = false;
+	host_cycle_count = 0;
+	host_tick_cycles = HOST_CLOCK_HZ / OS_TICK_RATE_HZ;
+	host_ticks = 0;
+	#if defined(OS_TRACE)
+		host_trace_sending = false;
+	#endif
+}
+
+// Every thread starts here, the first time it is switched to
+static void host_thread_main(void) {
+	thread_t* thread = os_thread_current;
+	host_irq_disabled = false;
+	setjmp(host_threads[thread->id].restart);
+	thread->entry_point();
+	os_exit();
+}
+
+void port_thread_init(thread_t* thread) {
+	if (host_threads[thread->id].stack == NULL) {
+		host_threads[thread->id].stack = malloc(HOST_STACK_SIZE);
+		OS_ASSERT(host_threads[thread->id].stack != NULL);
+	}
+	ucontext_t* context = &host_threads[thread->id].context;
+	getcontext(context);
+	context->uc_stack.ss_sp = host_threads[thread->id].stack;
+	context->uc_stack.ss_size = HOST_STACK_SIZE;
+	context->uc_link = NULL;
+	makecontext(context, host_thread_main, 0);
+}
+
+void port_request_switch(void) {
+	host_switch_pending = true;
+	port_exit_critical(host_irq_disabled);
+}
+
+void port_thread_restart(thread_t* thread) {
+	longjmp(host_threads[thread->id].restart, 1);
+}
+
+// The tick interrupt, taken whenever a thread lets time pass
+static void host_tick(void) {
+	if (host_ticks == host_ticks_end)
+		host_stop();
+	host_ticks++;
+	host_cycle_count += host_tick_cycles;
+	#if defined(OS_TRACE)
+		if (host_trace_sending) {
+			host_trace_sending = false;
+			os_trace_sent();
+		}
+	#endif
+	if (host_tick_hook != NULL)
+		host_tick_hook();
+	os_tick();
+}
+
+void port_idle(void) {
+	host_tick();
+}
+
+void port_spin(void) {
+	host_tick();
+}
+
+/*
+ * Tick timer
+ */
+// The counter is only ever looked at right after it reloaded
+void port_timer_init(uint32_t cycles) {
+	OS_ASSERT(cycles == host_tick_cycles);
+}
+
+uint32_t port_timer_count(void) {
+	return host_tick_cycles - 1;
+}
+
+uint32_t port_timer_reload(void) {
+	return host_tick_cycles - 1;
+}
+
+void port_timer_restart(uint32_t reload) {
+	(void) reload;
+}
+
+void port_timer_set_reload(uint32_t reload) {
+	(void) reload;
+}
+
+bool port_timer_pending(void) {
+	return false;
+}
+
+void port_timer_clear_pending(void) {
+}
+
+/*
+ * Clock
+ */
+uint32_t port_clock(void) {
+	return HOST_CLOCK_HZ;
+}
+
+uint32_t port_cycles(void) {
+	return host_cycle_count;
+}
+
+uint64_t host_cycles(void) {
+	return host_cycle_count;
+}
+
+/*
+ * Instrumentation
+ */
+#if defined(OS_DEBUG_GPIO)
+void port_debug_init(uint8_t id) {
+	(void) id;
+}
+
+void port_debug_set(uint8_t id, bool running) {
+	(void) id, (void) running;
+}
+#endif
+
+#if defined(OS_TRACE)
+void port_trace_send(const void* data, uint32_t size) {
+	(void) data, (void) size;
+	host_trace_sending = true;
+}
+#endif
+
+/*
+ * Handlers
+ */
+void assert_handler(const char* module, int line) {
+	fprintf(stderr, "%s:%d: assertion failed\n", module, line);
+	abort();
+}
+
+void host_stop(void) {
+	// Go back to host_switch() in host_run()
+	host_irq_disabled = true;
+	setcontext(&host_main_context);
+}
+
+void host_run(os_time_t ticks) {
+	host_ticks_end = ticks;
+	if (setjmp(host_exit) == 0)
+		os_start();
+}
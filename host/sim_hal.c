@@ -0,0 +1,157 @@
+#include "sim_hal.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "host.h"
+#include "miros.h"
+#include "port.h"
+#include "serial.h"
+
+sim_counters_t sim_counters;
+
+// Shared with host/sim_vl53l0x.c
+void sim_vl53l0x_reset(void);
+void sim_vl53l0x_pin(struct gpio* gpio, uint8_t pin, bool high);
+
+/*
+ * Pins
+ */
+void hal_pin_output(struct gpio* gpio, uint8_t pin) {
+	(void) gpio, (void) pin;
+}
+
+void hal_pin_write(struct gpio* gpio, uint8_t pin, bool high) {
+	sim_vl53l0x_pin(gpio, pin, high);
+}
+
+/*
+ * PWM
+ */
+void hal_pwm_init(uint32_t frequency) {
+	(void) frequency;
+}
+
+void hal_pwm_write(uint8_t duty_cycle) {
+	sim_counters.pwm_writes++;
+	sim_counters.pwm_duty_cycle = duty_cycle;
+}
+
+/*
+ * Storage
+ */
+static uint8_t sim_storage[HAL_STORAGE_SIZE];
+
+const void* hal_storage(void) {
+	return sim_storage;
+}
+
+bool hal_storage_write(const void* data, uint32_t size) {
+	if (size > HAL_STORAGE_SIZE)
+		return false;
+	memset(sim_storage, 0xFF, sizeof(sim_storage));
+	memcpy(sim_storage, data, size);
+	sim_counters.storage_writes++;
+	return true;
+}
+
+/*
+ * Serial port
+ */
+#if !defined(SERIAL_TX_BUFFER_SIZE)
+	#define SERIAL_TX_BUFFER_SIZE 256
+#endif
+#if !defined(SERIAL_RX_BUFFER_SIZE)
+	#define SERIAL_RX_BUFFER_SIZE 128
+#endif
+
+// The transmit buffer only keeps count of its bytes, which leave at one every
+// ten bit times from the cycle they can start at
+static struct {
+	uint32_t baud_rate;
+	uint32_t queued;
+	uint64_t cycle; // When the queued bytes started draining
+} sim_serial_tx;
+
+static struct {
+	uint8_t data[SERIAL_RX_BUFFER_SIZE];
+	uint32_t head;
+	uint32_t tail;
+	uint32_t overruns;
+	semaphore_t ready;
+} sim_serial_rx;
+
+void serial_init(uint32_t baud_rate) {
+	sim_serial_tx.baud_rate = baud_rate;
+	sim_serial_tx.queued = 0;
+	sim_serial_tx.cycle = host_cycles();
+	sim_serial_rx.head = 0;
+	sim_serial_rx.tail = 0;
+	sim_serial_rx.overruns = 0;
+	semaphore_init(&sim_serial_rx.ready, 1, 0);
+}
+
+uint32_t serial_write(const void* data, uint32_t size) {
+	(void) data;
+	OS_ASSERT(sim_serial_tx.baud_rate > 0);
+	port_critical_t critical = port_enter_critical();
+	uint64_t now = host_cycles();
+	uint64_t sent = (now - sim_serial_tx.cycle) * sim_serial_tx.baud_rate / 10 / HOST_CLOCK_HZ;
+	if (sent >= sim_serial_tx.queued) {
+		sim_serial_tx.queued = 0;
+		sim_serial_tx.cycle = now;
+	} else {
+		sim_serial_tx.queued -= sent;
+		sim_serial_tx.cycle += sent * 10 * HOST_CLOCK_HZ / sim_serial_tx.baud_rate;
+	}
+	uint32_t free = SERIAL_TX_BUFFER_SIZE - sim_serial_tx.queued;
+	uint32_t accepted = size < free ? size : free;
+	sim_serial_tx.queued += accepted;
+	sim_counters.serial_bytes += accepted;
+	sim_counters.serial_dropped += size - accepted;
+	port_exit_critical(critical);
+	return accepted;
+}
+
+void sim_serial_receive(const void* data, uint32_t size) {
+	const uint8_t* bytes = data;
+	port_critical_t critical = port_enter_critical();
+	for (uint32_t i = 0; i < size; i++)
+		sim_serial_rx.data[sim_serial_rx.head++ % SERIAL_RX_BUFFER_SIZE] = bytes[i];
+	if (sim_serial_rx.head - sim_serial_rx.tail > SERIAL_RX_BUFFER_SIZE) {
+		sim_serial_rx.overruns += sim_serial_rx.head - sim_serial_rx.tail - SERIAL_RX_BUFFER_SIZE;
+		sim_serial_rx.tail = sim_serial_rx.head - SERIAL_RX_BUFFER_SIZE;
+	}
+	port_exit_critical(critical);
+	if (size > 0)
+		semaphore_signal(&sim_serial_rx.ready);
+}
+
+uint32_t serial_available(void) {
+	return sim_serial_rx.head - sim_serial_rx.tail;
+}
+
+uint32_t serial_read(void* data, uint32_t size) {
+	uint8_t* bytes = data;
+	uint32_t available;
+	while ((available = serial_available()) == 0)
+		semaphore_wait(&sim_serial_rx.ready);
+	if (size > available)
+		size = available;
+	port_critical_t critical = port_enter_critical();
+	for (uint32_t i = 0; i < size; i++)
+		bytes[i] = sim_serial_rx.data[(sim_serial_rx.tail + i) % SERIAL_RX_BUFFER_SIZE];
+	sim_serial_rx.tail += size;
+	port_exit_critical(critical);
+	return size;
+}
+
+uint32_t serial_overruns(void) {
+	return sim_serial_rx.overruns;
+}
+
+void sim_reset(void) {
+	sim_vl53l0x_reset();
+	memset(sim_storage, 0xFF, sizeof(sim_storage));
+	memset(&sim_counters, 0, sizeof(sim_counters));
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hal.h"
+
+// Simulated peripherals of the host port, implementing hal.h and serial.h.
+// I2C transfers complete as soon as they are started, against a register model
+// of VL53L0X sensors. The serial port is a byte sink draining at its baud rate
+// in virtual time. Everything the drivers do is counted.
+
+typedef struct {
+	uint32_t i2c_transfers;
+	uint32_t i2c_bytes_written;
+	uint32_t i2c_bytes_read;
+	uint32_t i2c_nacks;
+	uint64_t i2c_wire_micros; // Time the transfers would take on the wire at 100 kHz
+	uint32_t serial_bytes; // Accepted by serial_write()
+	uint32_t serial_dropped; // Not accepted because the transmit buffer was full
+	uint32_t pwm_writes;
+	uint8_t pwm_duty_cycle;
+	uint32_t storage_writes;
+} sim_counters_t;
+
+extern sim_counters_t sim_counters;
+
+// Detach every sensor, erase the storage, and zero the counters
+void sim_reset(void);
+
+// A port of simulated pins, for XSHUT
+#define SIM_GPIO ((struct gpio*) &sim_counters)
+
+/*
+ * VL53L0X
+ */
+#define SIM_VL53L0X_MAX 8
+
+// Attach a sensor to the bus at the default address, held in reset while its
+// XSHUT pin is low if xshut_gpio isn't NULL. Returns its index.
+uint8_t sim_vl53l0x_attach(struct gpio* xshut_gpio, uint8_t xshut_pin);
+void sim_vl53l0x_set_range(uint8_t index, uint16_t millimeters);
+// Make a measurement ready if the sensor is ranging continuously. Returns
+// whether GPIO1 went low, in which case the caller plays the interrupt handler.
+bool sim_vl53l0x_measure(uint8_t index);
+
+/*
+ * Serial port
+ */
+// Bytes for serial_read()
+void sim_serial_receive(const void* data, uint32_t size);
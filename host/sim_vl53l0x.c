@@ -0,0 +1,184 @@
+#include "sim_hal.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "VL53L0X.h"
+
+// Register model of the VL53L0X, just deep enough for the driver: registers
+// are kept per page, selected by writing 0xFF, and the index increments on
+// every byte. Measurements and the reference calibration complete as soon as
+// they are started, except in continuous mode where sim_vl53l0x_measure()
+// completes them.
+static struct {
+	bool attached;
+	bool in_reset;
+	struct gpio* xshut_gpio;
+	uint8_t xshut_pin;
+	uint8_t address;
+	uint8_t page;
+	bool continuous;
+	uint16_t range;
+	uint8_t registers[8][256];
+} sim_sensors[SIM_VL53L0X_MAX];
+
+// One transfer at a time, and the callbacks of those started from a callback
+// are called in a loop rather than recursively
+static struct i2c_transfer* sim_i2c_pending;
+static bool sim_i2c_completing;
+
+/*
+ * VL53L0X
+ */
+static void sim_vl53l0x_power_on(uint8_t index) {
+	memset(sim_sensors[index].registers, 0, sizeof(sim_sensors[index].registers));
+	uint8_t* page0 = sim_sensors[index].registers[0];
+	page0[IDENTIFICATION_MODEL_ID] = 0xEE;
+	page0[I2C_SLAVE_DEVICE_ADDRESS] = VL53L0X_DEFAULT_ADDRESS;
+	memset(&page0[GLOBAL_CONFIG_SPAD_ENABLES_REF_0], 0xFF, 6);
+	page0[0xCB] = 0x20; // VHV settings
+	page0[0xEE] = 0x10; // Phase calibration
+	sim_sensors[index].registers[7][0x92] = 0x85; // 5 aperture reference SPADs
+	sim_sensors[index].address = VL53L0X_DEFAULT_ADDRESS;
+	sim_sensors[index].page = 0;
+	sim_sensors[index].continuous = false;
+}
+
+static void sim_vl53l0x_complete(uint8_t index) {
+	uint8_t* page0 = sim_sensors[index].registers[0];
+	page0[RESULT_INTERRUPT_STATUS] = 0x04; // New sample ready
+	page0[RESULT_RANGE_STATUS + 10] = sim_sensors[index].range >> 8;
+	page0[RESULT_RANGE_STATUS + 11] = sim_sensors[index].range & 0xFF;
+}
+
+static void sim_vl53l0x_write(uint8_t index, uint8_t reg, uint8_t value) {
+	uint8_t page = sim_sensors[index].page;
+	if (reg == 0xFF) {
+		sim_sensors[index].page = value & 7;
+		return;
+	}
+	sim_sensors[index].registers[page][reg] = value;
+	if (page == 7 && reg == 0x83 && value == 0x00) {
+		// The SPAD information is read from NVM right away
+		sim_sensors[index].registers[7][0x83] = 0x10;
+	} else if (page == 0 && reg == SYSRANGE_START) {
+		sim_sensors[index].continuous = value == 0x02 || value == 0x04;
+		if (value & 0x01) {
+			// Single-shot measurement or reference calibration, over already
+			sim_sensors[index].registers[0][SYSRANGE_START] = value & ~0x01;
+			sim_vl53l0x_complete(index);
+		}
+	} else if (page == 0 && reg == SYSTEM_INTERRUPT_CLEAR && (value & 0x01)) {
+		sim_sensors[index].registers[0][RESULT_INTERRUPT_STATUS] = 0;
+	} else if (page == 0 && reg == I2C_SLAVE_DEVICE_ADDRESS) {
+		sim_sensors[index].address = value & 0x7F;
+	}
+}
+
+void sim_vl53l0x_reset(void) {
+	memset(sim_sensors, 0, sizeof(sim_sensors));
+	sim_i2c_pending = NULL;
+	sim_i2c_completing = false;
+}
+
+void sim_vl53l0x_pin(struct gpio* gpio, uint8_t pin, bool high) {
+	for (uint8_t i = 0; i < SIM_VL53L0X_MAX; i++) {
+		if (!sim_sensors[i].attached || sim_sensors[i].xshut_gpio != gpio || sim_sensors[i].xshut_pin != pin)
+			continue;
+		if (high && sim_sensors[i].in_reset)
+			sim_vl53l0x_power_on(i);
+		sim_sensors[i].in_reset = !high;
+	}
+}
+
+uint8_t sim_vl53l0x_attach(struct gpio* xshut_gpio, uint8_t xshut_pin) {
+	uint8_t index = 0;
+	while (index < SIM_VL53L0X_MAX && sim_sensors[index].attached)
+		index++;
+	OS_ASSERT(index < SIM_VL53L0X_MAX);
+	sim_sensors[index].attached = true;
+	sim_sensors[index].in_reset = false;
+	sim_sensors[index].xshut_gpio = xshut_gpio;
+	sim_sensors[index].xshut_pin = xshut_pin;
+	sim_sensors[index].range = 8190; // Out of range
+	sim_vl53l0x_power_on(index);
+	return index;
+}
+
+void sim_vl53l0x_set_range(uint8_t index, uint16_t millimeters) {
+	OS_ASSERT(index < SIM_VL53L0X_MAX && sim_sensors[index].attached);
+	sim_sensors[index].range = millimeters;
+}
+
+bool sim_vl53l0x_measure(uint8_t index) {
+	OS_ASSERT(index < SIM_VL53L0X_MAX && sim_sensors[index].attached);
+	if (sim_sensors[index].in_reset || !sim_sensors[index].continuous)
+		return false;
+	sim_vl53l0x_complete(index);
+	return true;
+}
+
+/*
+ * I2C
+ */
+// A byte takes 9 bit times at 100 kHz, plus about a byte for start and stop
+static void sim_i2c_count(const struct i2c_transfer* transfer) {
+	uint32_t bytes = 1 + transfer->write_size + 1;
+	if (transfer->read_size > 0)
+		bytes += 1 + transfer->read_size;
+	sim_counters.i2c_transfers++;
+	sim_counters.i2c_wire_micros += bytes * 9 * 10;
+}
+
+static void sim_i2c_run(struct i2c_transfer* transfer) {
+	sim_i2c_count(transfer);
+	uint8_t index = 0;
+	while (index < SIM_VL53L0X_MAX && (!sim_sensors[index].attached || sim_sensors[index].in_reset || sim_sensors[index].address != transfer->slave_address))
+		index++;
+	if (index == SIM_VL53L0X_MAX) {
+		sim_counters.i2c_nacks++;
+		transfer->status = I2C_NACK;
+		return;
+	}
+
+	// The first byte written is the register index
+	static uint8_t reg[SIM_VL53L0X_MAX];
+	for (uint16_t i = 0; i < transfer->write_size; i++) {
+		if (i == 0)
+			reg[index] = transfer->write_data[0];
+		else
+			sim_vl53l0x_write(index, reg[index]++, transfer->write_data[i]);
+	}
+	for (uint16_t i = 0; i < transfer->read_size; i++)
+		transfer->read_data[i] = sim_sensors[index].registers[sim_sensors[index].page][reg[index]++];
+	sim_counters.i2c_bytes_written += transfer->write_size;
+	sim_counters.i2c_bytes_read += transfer->read_size;
+	transfer->status = I2C_OK;
+}
+
+void hal_i2c_init(void) {
+	sim_i2c_pending = NULL;
+	sim_i2c_completing = false;
+}
+
+bool hal_i2c_start(struct i2c_transfer* transfer) {
+	if (sim_i2c_pending != NULL)
+		return false;
+	transfer->status = I2C_BUSY;
+	sim_i2c_pending = transfer;
+	if (sim_i2c_completing)
+		return true;
+	sim_i2c_completing = true;
+	while (sim_i2c_pending != NULL) {
+		struct i2c_transfer* current = sim_i2c_pending;
+		sim_i2c_run(current);
+		sim_i2c_pending = NULL;
+		current->callback(current);
+	}
+	sim_i2c_completing = false;
+	return true;
+}
+
+void hal_i2c_abort(void) {
+	sim_i2c_pending = NULL;
+}
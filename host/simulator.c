@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "miros.h"
+#include "port.h"
+
+// Replays a task set and a trace of aperiodic arrivals through the kernel in
+// virtual time, for a hyperperiod after the last offset unless told how many
+// ticks to run. The task set is read from a file, or standard input, of lines:
+//   bandwidth <numerator>/<denominator>     Of the aperiodic server, or auto, the default
+//   task <name> <C> <D> <T> [<offset>]      A periodic task
+//   aperiodic <arrival> <C>                 A request to the aperiodic server
+// in ticks, with # starting a comment. Periodic tasks burn their computation
+// time and are otherwise independent. The output is made of lines:
+//   rejected <name>                         Not admitted by os_add_thread()
+//   run <name> <start> <end>                The schedule, idle included
+//   job <name> <release> <completion> <deadline> <response> <missed>
+//   task <name> <jobs> <misses> <max response>
+// with aperiodic requests named "aperiodic" and released on arrival. The exit
+// status is 1 if any task was rejected or any deadline was missed, including by
+// periodic jobs still unfinished at the end.
+
+#define SIMULATOR_MAX_TASKS (OS_MAX_THREADS - 2)
+#define SIMULATOR_MAX_ARRIVALS 4096
+
+static struct {
+	char name[32];
+	thread_t thread;
+	uint32_t jobs;
+	uint32_t misses;
+	os_time_t max_response;
+} tasks[SIMULATOR_MAX_TASKS + 1]; // The last one stands for the aperiodic requests
+static uint32_t tasks_count;
+static uint32_t server_bandwidth = OS_SERVER_BANDWIDTH_AUTO;
+
+static struct {
+	os_time_t arrival;
+	uint32_t computation_time;
+} arrivals[SIMULATOR_MAX_ARRIVALS];
+static uint32_t arrivals_count;
+static uint32_t arrivals_enqueued;
+
+// Task of each thread id, the rest are the idle thread and the server
+static int32_t task_of_thread[OS_MAX_THREADS];
+static uint8_t server_id = UINT8_MAX;
+
+static const char* thread_name(const thread_t* thread) {
+	if (task_of_thread[thread->id] >= 0)
+		return tasks[task_of_thread[thread->id]].name;
+	return thread->id == server_id ? "server" : "idle";
+}
+
+static void job_completed(uint32_t task, os_time_t release, os_time_t deadline) {
+	os_time_t completion = os_current_ticks();
+	os_time_t response = completion - release;
+	// Late as the kernel sees it, see os_exit()
+	bool missed = completion > deadline;
+	tasks[task].jobs++;
+	tasks[task].misses += missed;
+	if (response > tasks[task].max_response)
+		tasks[task].max_response = response;
+	printf("job %s %llu %llu %llu %llu %d\n", tasks[task].name, (unsigned long long) release,
+		(unsigned long long) completion, (unsigned long long) deadline, (unsigned long long) response, missed);
+}
+
+/*
+ * Threads
+ */
+static void task_main(void) {
+	thread_t* thread = os_thread_current;
+	os_burn(thread->computation_time);
+	job_completed(task_of_thread[thread->id], thread->activation_time, thread->absolute_deadline);
+}
+
+// Each request carries the index of its arrival
+static void aperiodic_main(aperiodic_task_t* aperiodic_task) {
+	server_id = os_thread_current->id;
+	uint32_t arrival = aperiodic_task->payload.words[0];
+	os_burn(arrivals[arrival].computation_time);
+	job_completed(tasks_count, arrivals[arrival].arrival, os_thread_current->absolute_deadline);
+}
+
+// The schedule is written a run at a time, as the thread running over the tick
+// that is ending changes
+static const thread_t* run_thread;
+static os_time_t run_start;
+
+static void run_flush(os_time_t end) {
+	if (run_thread != NULL && end > run_start)
+		printf("run %s %llu %llu\n", thread_name(run_thread), (unsigned long long) run_start, (unsigned long long) end);
+}
+
+static void tick_hook(void) {
+	os_time_t now = os_current_ticks();
+	if (os_thread_current != run_thread) {
+		run_flush(now);
+		run_thread = os_thread_current;
+		run_start = now;
+	}
+
+	// Requests that arrived during this tick, as the button interrupt would
+	while (arrivals_enqueued < arrivals_count && arrivals[arrivals_enqueued].arrival <= now) {
+		aperiodic_task_t* aperiodic_task = os_reserve_aperiodic_task();
+		if (aperiodic_task == NULL) {
+			fprintf(stderr, "aperiodic request at %llu rejected, the queue is full or the server has no bandwidth\n", (unsigned long long) now);
+			exit(EXIT_FAILURE);
+		}
+		aperiodic_task->entry_point = &aperiodic_main;
+		aperiodic_task->computation_time = arrivals[arrivals_enqueued].computation_time;
+		aperiodic_task->payload.words[0] = arrivals_enqueued++;
+		os_submit_aperiodic_task(aperiodic_task);
+	}
+}
+
+/*
+ * Task set
+ */
+static bool parse(FILE* file) {
+	char line[256];
+	uint32_t line_number = 0;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		line_number++;
+		char* comment = strchr(line, '#');
+		if (comment != NULL)
+			*comment = '\0';
+
+		char keyword[16];
+		if (sscanf(line, "%15s", keyword) != 1)
+			continue;
+		if (strcmp(keyword, "bandwidth") == 0) {
+			uint32_t numerator, denominator;
+			char word[8];
+			if (sscanf(line, "%*s %u/%u", &numerator, &denominator) == 2 && numerator <= denominator && denominator > 0) {
+				server_bandwidth = OS_SERVER_BANDWIDTH(numerator, denominator);
+				continue;
+			}
+			if (sscanf(line, "%*s %7s", word) == 1 && strcmp(word, "auto") == 0) {
+				server_bandwidth = OS_SERVER_BANDWIDTH_AUTO;
+				continue;
+			}
+		} else if (strcmp(keyword, "task") == 0 && tasks_count < SIMULATOR_MAX_TASKS) {
+			thread_t* thread = &tasks[tasks_count].thread;
+			*thread = (thread_t) {.entry_point = &task_main};
+			int fields = sscanf(line, "%*s %31s %u %u %u %u", tasks[tasks_count].name,
+				&thread->computation_time, &thread->relative_deadline, &thread->period, &thread->offset);
+			if (fields >= 4 && thread->period > 0) {
+				tasks_count++;
+				continue;
+			}
+		} else if (strcmp(keyword, "aperiodic") == 0 && arrivals_count < SIMULATOR_MAX_ARRIVALS) {
+			unsigned long long arrival;
+			uint32_t computation_time;
+			if (sscanf(line, "%*s %llu %u", &arrival, &computation_time) == 2) {
+				if (arrivals_count > 0 && arrival < arrivals[arrivals_count - 1].arrival) {
+					fprintf(stderr, "%u: arrivals out of order\n", line_number);
+					return false;
+				}
+				arrivals[arrivals_count].arrival = arrival;
+				arrivals[arrivals_count].computation_time = computation_time;
+				arrivals_count++;
+				continue;
+			}
+		}
+		fprintf(stderr, "%u: invalid line\n", line_number);
+		return false;
+	}
+	return true;
+}
+
+static os_time_t gcd(os_time_t a, os_time_t b) {
+	while (b != 0) {
+		os_time_t r = a % b;
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+// Zero if the hyperperiod is too long to be worth simulating
+static os_time_t hyperperiod(void) {
+	os_time_t hyperperiod = 1;
+	os_time_t max_offset = 0;
+	for (uint32_t i = 0; i < tasks_count; i++) {
+		const thread_t* thread = &tasks[i].thread;
+		hyperperiod = hyperperiod / gcd(hyperperiod, thread->period) * thread->period;
+		if (hyperperiod > OS_SECONDS(3600))
+			return 0;
+		if (thread->offset > max_offset)
+			max_offset = thread->offset;
+	}
+	if (arrivals_count > 0 && arrivals[arrivals_count - 1].arrival > max_offset)
+		max_offset = arrivals[arrivals_count - 1].arrival;
+	return max_offset + hyperperiod;
+}
+
+int main(int argc, char** argv) {
+	FILE* file = argc > 1 && strcmp(argv[1], "-") != 0 ? fopen(argv[1], "r") : stdin;
+	if (file == NULL) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+	if (!parse(file))
+		return EXIT_FAILURE;
+	os_time_t ticks = argc > 2 ? strtoull(argv[2], NULL, 0) : hyperperiod();
+	if (ticks == 0) {
+		fprintf(stderr, "hyperperiod too long, give the number of ticks to run\n");
+		return EXIT_FAILURE;
+	}
+
+	os_init(server_bandwidth);
+	for (uint32_t i = 0; i < OS_MAX_THREADS; i++)
+		task_of_thread[i] = -1;
+	bool rejected = false;
+	for (uint32_t i = 0; i < tasks_count; i++) {
+		if (os_add_thread(&tasks[i].thread)) {
+			task_of_thread[tasks[i].thread.id] = i;
+		} else {
+			printf("rejected %s\n", tasks[i].name);
+			tasks[i].thread.state = OS_THREAD_INACTIVE;
+			rejected = true;
+		}
+	}
+	strcpy(tasks[tasks_count].name, "aperiodic");
+
+	host_tick_hook = &tick_hook;
+	host_run(ticks);
+	run_flush(ticks);
+
+	// Periodic jobs released but not completed by the end, and already late
+	bool missed = false;
+	for (uint32_t i = 0; i < tasks_count; i++) {
+		const thread_t* thread = &tasks[i].thread;
+		if (thread->state != OS_THREAD_SLEEPING && thread->state != OS_THREAD_INACTIVE && thread->absolute_deadline <= ticks)
+			tasks[i].misses++;
+	}
+
+	for (uint32_t i = 0; i <= tasks_count; i++) {
+		if (i == tasks_count && arrivals_count == 0)
+			break;
+		printf("task %s %u %u %llu\n", tasks[i].name, tasks[i].jobs, tasks[i].misses, (unsigned long long) tasks[i].max_response);
+		missed |= tasks[i].misses > 0;
+	}
+	return rejected || missed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "host.h"
+#include "miros.h"
+
+// Scheduling cases the demonstrators do not run into, each set up from scratch
+// and run for a few ticks. Prints a line per test and exits with status 1 if
+// any of them failed.
+
+static uint32_t jobs;
+static resource_t resource;
+
+/*
+ * A thread with the longest relative deadline, and so the lowest preemption
+ * level, runs while no resource is locked
+ */
+static void unbounded_main(void) {
+	jobs++;
+	os_burn(1);
+}
+
+static bool test_unbounded_deadline(void) {
+	os_init(OS_SERVER_BANDWIDTH(1, 4));
+	static thread_t thread;
+	thread = (thread_t) {
+		.entry_point = &unbounded_main,
+		.relative_deadline = UINT32_MAX,
+		.period = 2,
+	};
+	OS_ASSERT(os_add_thread(&thread));
+	jobs = 0;
+	host_run(10);
+	return jobs >= 5;
+}
+
+/*
+ * A job that overran its period goes on with the next one without a switch,
+ * and may still lock the resources it uses
+ */
+static void overrun_main(void) {
+	if (jobs++ == 0) {
+		os_burn(15);
+		return;
+	}
+	resource_lock(&resource);
+	os_burn(1);
+	resource_unlock(&resource);
+}
+
+static bool test_overrun_lock(void) {
+	os_init(OS_SERVER_BANDWIDTH(1, 4));
+	resource_init(&resource);
+	static thread_t thread;
+	thread = (thread_t) {
+		.entry_point = &overrun_main,
+		.relative_deadline = 10,
+		.period = 10,
+	};
+	OS_ASSERT(os_add_thread(&thread));
+	resource_use(&resource, &thread);
+	jobs = 0;
+	host_run(200);
+	return jobs == 21;
+}
+
+/*
+ * A thread that would take bandwidth from the server is turned down while a
+ * request given a deadline with that bandwidth is outstanding, and admitted
+ * once it is over
+ */
+static bool served, admitted_busy, admitted_idle;
+static thread_t shrinking;
+
+static void request_main(aperiodic_task_t* aperiodic_task) {
+	(void) aperiodic_task;
+	os_burn(3);
+	served = true;
+}
+
+static void shrinking_main(void) {
+	os_burn(2);
+}
+
+static void bandwidth_main(void) {
+	jobs++;
+	if (jobs == 1) {
+		// Served with 3/4 of the processor, by tick 4
+		OS_ASSERT(os_enqueue_aperiodic_task(&request_main, 3));
+		admitted_busy = os_add_thread(&shrinking);
+	} else if (jobs == 5) {
+		// Past the deadline of the request, whichever the server
+		admitted_idle = os_add_thread(&shrinking);
+	}
+	os_burn(1);
+}
+
+static bool test_server_bandwidth(void) {
+	os_init(OS_SERVER_BANDWIDTH_AUTO);
+	static thread_t thread;
+	thread = (thread_t) {
+		.entry_point = &bandwidth_main,
+		.computation_time = 1,
+		.relative_deadline = 4,
+		.period = 4,
+	};
+	shrinking = (thread_t) {
+		.entry_point = &shrinking_main,
+		.computation_time = 2,
+		.relative_deadline = 4,
+		.period = 4,
+	};
+	OS_ASSERT(os_add_thread(&thread));
+	jobs = 0;
+	served = admitted_busy = admitted_idle = false;
+	host_run(20);
+	return served && !admitted_busy && admitted_idle;
+}
+
+int main(void) {
+	static const struct {
+		const char* name;
+		bool (*run)(void);
+	} tests[] = {
+		{"unbounded_deadline", &test_unbounded_deadline},
+		{"overrun_lock", &test_overrun_lock},
+		{"server_bandwidth", &test_server_bandwidth},
+	};
+	bool failed = false;
+	for (uint32_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		bool passed = tests[i].run();
+		printf("%s %s\n", tests[i].name, passed ? "ok" : "FAILED");
+		failed |= !passed;
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -4,6 +4,10 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "bus.h"
+#include "miros.h"
+#include "hal.h"
+
 
     // register addresses from API vl53l0x_device.h (ordered as listed there)
     enum VL53L0X_regAddr
@@ -93,15 +97,53 @@
 
     enum VL53L0X_vcselPeriodType { VcselPeriodPreRange, VcselPeriodFinalRange };
 
+    // Address of every sensor after reset
+    #define VL53L0X_DEFAULT_ADDRESS 0b0101001
+
+    // Number of configuration registers kept in the register shadow
+    #define VL53L0X_SHADOW_SIZE 15
+
+    // Largest count accepted by VL53L0X_writeMulti()
+    #define VL53L0X_MULTI_MAX 6
+
+	// Results of the reference calibration, which can be saved to flash with
+	// VL53L0X_saveCalibration() so later boots can skip it
+	struct VL53L0X_calibration
+	{
+		uint8_t spad_count;
+		bool spad_type_is_aperture;
+		uint8_t ref_spad_map[6]; // As enabled, with only spad_count bits set
+		uint8_t vhv_settings; // Register 0xCB
+		uint8_t phase_cal; // Register 0xEE
+	};
+
+	// Number of sensors whose calibration fits in the saved blob
+	#define VL53L0X_CALIBRATION_MAX 8
+
     struct VL53L0X {
-		uint8_t last_status; // status of last I2C transmission
+		uint8_t last_status; // bus_status_t of the last I2C transfer
 		bool io_2v8;
 		uint8_t address;
+		struct gpio* xshut_gpio; // Pin wired to XSHUT, for VL53L0X_initMultiple()
+		uint8_t xshut_pin;
 		uint32_t io_timeout;
 		bool did_timeout;
 		uint32_t timeout_start_ms;
 		uint8_t stop_variable; // read by init and used when starting measurement; is StopVariable field of VL53L0X_DevData_t structure in API
 		uint32_t measurement_timing_budget_us;	
+		struct VL53L0X_calibration calibration; // Filled in by init
+
+		// Register shadow, see VL53L0X_shadowRegs
+		uint8_t page; // Selected register page
+		uint8_t private_mode; // Last value written to 0x80
+		uint8_t shadow[VL53L0X_SHADOW_SIZE];
+		uint16_t shadow_valid;
+
+		// Asynchronous ranging, see VL53L0X_dataReady()
+		bus_job_t range_job;
+		uint8_t range_buffer[2];
+		uint16_t range;
+		semaphore_t range_ready;
 	};
 	
 	/* TCC: Target CentreCheck
@@ -121,6 +163,12 @@
 
 	void VL53L0X_setAddress(struct VL53L0X* dev, uint8_t new_addr);
     bool VL53L0X_init(struct VL53L0X* dev);
+    bool VL53L0X_initCalibrated(struct VL53L0X* dev, const struct VL53L0X_calibration* calibration);
+    bool VL53L0X_saveCalibration(struct VL53L0X* devs, uint8_t count);
+    bool VL53L0X_loadCalibration(uint8_t index, struct VL53L0X_calibration* calibration);
+    bool VL53L0X_initMultiple(struct VL53L0X* devs, uint8_t count);
+    void VL53L0X_startContinuousMultiple(struct VL53L0X* devs, uint8_t count, uint32_t period_ms);
+    uint8_t VL53L0X_waitRangesMillimeters(struct VL53L0X* devs, uint8_t count, uint16_t* ranges);
 
     void VL53L0X_writeReg(struct VL53L0X* dev, uint8_t reg, uint8_t value);
     void VL53L0X_writeReg16Bit(struct VL53L0X* dev, uint8_t reg, uint16_t value);
@@ -146,6 +194,9 @@
     uint16_t VL53L0X_readRangeContinuousMillimeters(struct VL53L0X* dev);
     uint16_t VL53L0X_readRangeSingleMillimeters(struct VL53L0X* dev);
 
+    void VL53L0X_dataReady(struct VL53L0X* dev);
+    uint16_t VL53L0X_waitRangeMillimeters(struct VL53L0X* dev);
+
     bool VL53L0X_timeoutOccurred(struct VL53L0X* dev);
 
     bool VL53L0X_getSpadInfo(struct VL53L0X* dev, uint8_t * count, bool * type_is_aperture);
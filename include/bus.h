@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "hal.h"
+
+/*
+ * I2C bus
+ */
+// Transfers on the I2C bus are queued as jobs and run one after the other by the
+// interrupt handlers. The blocking calls suspend the calling thread until their
+// job is over, or spin if the operating system hasn't been started yet.
+typedef enum {
+	BUS_PENDING,
+	BUS_OK,
+	BUS_NACK,
+	BUS_ARBITRATION_LOST,
+	BUS_ERROR,
+	BUS_TIMEOUT,
+} bus_status_t;
+
+// A script is a static sequence of register accesses on one device, run as a
+// single job without waking up the thread in between. Writes to consecutive
+// registers are sent as one burst, relying on the device incrementing the
+// register index, and reads of several bytes are a single burst too.
+typedef enum {
+	BUS_OP_END,
+	BUS_OP_WRITE, // Write value to the register
+	BUS_OP_WRITE_ARG, // Write the job's args[value] to the register
+	BUS_OP_READ, // Read value bytes from the register into the job's results
+} bus_op_type_t;
+
+typedef struct {
+	uint8_t type;
+	uint8_t reg;
+	uint8_t value;
+} bus_op_t;
+
+#define BUS_WRITE(reg, value) {BUS_OP_WRITE, (reg), (value)}
+#define BUS_WRITE_ARG(reg, index) {BUS_OP_WRITE_ARG, (reg), (index)}
+#define BUS_READ(reg, count) {BUS_OP_READ, (reg), (count)}
+#define BUS_END {BUS_OP_END, 0, 0}
+
+// Longest run of consecutive registers written in one burst
+#define BUS_BURST_MAX 8
+
+typedef struct bus_job {
+	struct i2c_transfer transfer; // Must be the first member
+	volatile bus_status_t status;
+	void (*callback)(struct bus_job* job); // Called from an interrupt handler
+	void* context;
+	struct bus_job* next;
+
+	// Only for scripts, otherwise the transfer is run as is
+	const bus_op_t* script;
+	const uint8_t* args;
+	uint8_t* results;
+	uint16_t results_size;
+	uint8_t burst[1 + BUS_BURST_MAX];
+} bus_job_t;
+
+void bus_init(void);
+
+// Queue a job, whose callback is called once it is over
+void bus_submit(bus_job_t* job);
+// Take a job out of the queue, aborting it if it is in progress
+void bus_cancel(bus_job_t* job);
+
+bus_status_t bus_write(uint8_t slave_address, const uint8_t* data, uint16_t size);
+bus_status_t bus_read(uint8_t slave_address, uint8_t* data, uint16_t size);
+// Write then read after a repeated start, as in reading a register
+bus_status_t bus_write_read(uint8_t slave_address, const uint8_t* write_data, uint16_t write_size, uint8_t* read_data, uint16_t read_size);
+// Results must have room for every byte read by the script
+bus_status_t bus_run_script(uint8_t slave_address, const bus_op_t* script, const uint8_t* args, uint8_t* results);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Peripherals as the drivers see them, so the drivers can be run against
+// simulated ones. src/hal.c is the STM32F103 backend, and host/sim_hal.c with
+// host/sim_vl53l0x.c the simulated one of the host port; which one is used is
+// decided by what gets linked. The serial port is the same kind of boundary,
+// with include/serial.h implemented by src/serial.c and host/sim_hal.c.
+
+/*
+ * Pins
+ */
+// Ports are opaque here, see GPIOA and the others in stm32.h
+struct gpio;
+
+void hal_pin_output(struct gpio* gpio, uint8_t pin);
+void hal_pin_write(struct gpio* gpio, uint8_t pin, bool high);
+
+/*
+ * I2C
+ */
+// Asynchronous transfers on the one bus: write_size bytes are written, then
+// read_size bytes are read after a repeated start, and the callback is called
+// from the interrupt handler once the transfer is over.
+enum i2c_status {
+	I2C_BUSY,
+	I2C_OK,
+	I2C_NACK, // The slave didn't acknowledge its address or a byte
+	I2C_ARBITRATION_LOST,
+	I2C_BUS_ERROR,
+};
+
+struct i2c_transfer {
+	uint8_t slave_address;
+	const uint8_t* write_data;
+	uint16_t write_size;
+	uint8_t* read_data;
+	uint16_t read_size;
+	volatile uint8_t status;
+	void (*callback)(struct i2c_transfer* transfer);
+};
+
+void hal_i2c_init(void);
+// Returns false if a transfer is already in progress
+bool hal_i2c_start(struct i2c_transfer* transfer);
+// Give up on the transfer in progress without calling its callback
+void hal_i2c_abort(void);
+
+/*
+ * PWM
+ */
+void hal_pwm_init(uint32_t frequency);
+void hal_pwm_write(uint8_t duty_cycle); // In percent
+
+/*
+ * Storage
+ */
+// One page of non-volatile memory, erased to 0xFF
+#define HAL_STORAGE_SIZE 1024
+
+const void* hal_storage(void);
+// Replace the whole page with size bytes of data, padding the rest with 0xFF
+bool hal_storage_write(const void* data, uint32_t size);
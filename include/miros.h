@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /*
@@ -10,46 +11,131 @@
 
 void assert_handler(const char* const file, int line);
 
+/*
+ * Time
+ */
+// Kernel time is a 64-bit count of ticks since os_init(), which never wraps in
+// practice. The tick rate can be raised for sub-millisecond deadlines.
+#if !defined(OS_TICK_RATE_HZ)
+	#define OS_TICK_RATE_HZ 1000
+#endif
+
+typedef uint64_t os_time_t;
+
 /*
  * Aperiodic task
  */
-typedef struct {
-	void (*entry_point)(void);
-	uint32_t absolute_deadline;
+// Bytes of data a request can carry inline
+#if !defined(OS_APERIODIC_PAYLOAD_SIZE)
+	#define OS_APERIODIC_PAYLOAD_SIZE 8
+#endif
+_Static_assert(OS_APERIODIC_PAYLOAD_SIZE % 4 == 0, "the aperiodic payload is made of words");
+
+// A request lives in its queue slot from os_reserve_aperiodic_task() until
+// its completion callback returns, and the server hands the entry point and
+// the callback that slot, so the payload is never copied
+typedef struct aperiodic_task {
+	void (*entry_point)(struct aperiodic_task* aperiodic_task);
+	uint32_t computation_time;
+	os_time_t arrival_time; // Set by os_reserve_aperiodic_task()
+	union {
+		uint8_t bytes[OS_APERIODIC_PAYLOAD_SIZE];
+		uint32_t words[OS_APERIODIC_PAYLOAD_SIZE / 4];
+		void* buffer; // Larger data, owned by the request until it completes
+	} payload;
+	// Called by the server once the entry point returns, to give the buffer back
+	// to its pool for instance, or NULL
+	void (*completion)(struct aperiodic_task* aperiodic_task);
 } aperiodic_task_t;
 
-bool os_enqueue_aperiodic_task(void (*entry_point)(void), uint32_t computation_time);
+bool os_enqueue_aperiodic_task(void (*entry_point)(aperiodic_task_t* aperiodic_task), uint32_t computation_time);
+// Claim a queue slot to fill in place, or return NULL if the request has to be
+// dropped. Every slot claimed must be submitted, as the server serves requests
+// in the order their slots were claimed.
+aperiodic_task_t* os_reserve_aperiodic_task(void);
+void os_submit_aperiodic_task(aperiodic_task_t* aperiodic_task);
+// Number of requests refused because the queue was full or the server had no
+// bandwidth, and most requests ever queued at once
+uint32_t os_aperiodic_dropped(void);
+uint32_t os_aperiodic_high_water(void);
 
 /*
  * Thread
  */
+#if !defined(OS_MAX_THREADS)
+	#define OS_MAX_THREADS 32
+#endif
+_Static_assert(OS_MAX_THREADS <= 255, "thread ids and queue indices are 8 bits wide");
+
+typedef enum {
+	OS_THREAD_INACTIVE, // Not in any queue, waiting to be activated by the kernel
+	OS_THREAD_READY, // In the ready queue, ordered by absolute deadline
+	OS_THREAD_SLEEPING, // In the release queue, ordered by release time, and maybe in a semaphore's wait list until a timeout
+	OS_THREAD_BLOCKED, // In a semaphore's wait list, or held back by the system ceiling
+} os_thread_state_t;
+
+// Execution statistics of a thread, kept when compiled with OS_STATS
 typedef struct {
+	uint32_t jobs; // Number of completed jobs
+	uint32_t deadline_misses; // Number of jobs completed after their deadline
+	uint32_t max_execution_cycles;
+	uint64_t total_execution_cycles; // Of all completed jobs
+	uint32_t max_response_micros; // From release to completion
+	uint32_t max_release_jitter_micros; // From release to first dispatch
+
+	// Bookkeeping of the current job
+	uint32_t job_cycles;
+	uint32_t switch_cycle;
+} os_thread_stats_t;
+
+typedef struct thread {
 	// These *must* be the first three members of this struct, in *this* order.
-	// If they are to be moved around, make sure to update the offsets in the
-	// os_exit() and pendsv_handler() functions.
+	// If they are to be moved around, make sure to update the offsets in
+	// pendsv_handler() in src/port.c.
 	void* stack_begin;
 	uint32_t* stack_pointer;
 	void (*entry_point)(void);
 
 	uint8_t id;
 
-	uint32_t computation_time;
+	uint32_t computation_time; // Worst case, in ticks, for admission by os_add_thread()
 	uint32_t relative_deadline;
 	uint32_t period;
+	uint32_t offset; // Of the first release, from os_add_thread()
+
+	os_time_t activation_time;
+	os_time_t delayed_until;
+
+	// Scheduler bookkeeping, managed by the kernel
+	os_time_t absolute_deadline;
+	os_time_t queue_key;
+	uint8_t queue_index;
+	uint8_t state;
+	bool started; // Whether the current job has been dispatched yet
+	struct thread* list_next;
+	struct semaphore* semaphore; // Semaphore whose wait list the thread is in
 
-	uint32_t activation_time;
-	uint32_t delayed_until;
+	#if defined(OS_STATS)
+		os_thread_stats_t stats;
+	#endif
 } thread_t;
 
 /*
  * Operating system
  */
-#define OS_MILLIS(ms) (ms)
-#define OS_SECONDS(s) ((s) * OS_MILLIS(1000))
+#define OS_MICROS(us) ((us) * OS_TICK_RATE_HZ / 1000000)
+#define OS_MILLIS(ms) ((ms) * OS_TICK_RATE_HZ / 1000)
+#define OS_SECONDS(s) ((s) * OS_TICK_RATE_HZ)
 
-void os_init(uint32_t server_inverse_bandwidth);
-void os_add_thread(thread_t* thread);
+// Bandwidth of the aperiodic server, as a fraction of the processor
+#define OS_SERVER_BANDWIDTH(numerator, denominator) ((uint32_t) (((uint64_t) (numerator) << 16) / (denominator)))
+// Whatever the periodic threads leave, updated as they are added
+#define OS_SERVER_BANDWIDTH_AUTO UINT32_MAX
+
+void os_init(uint32_t server_bandwidth);
+bool os_add_thread(thread_t* thread);
 void os_start(void);
+bool os_running(void);
 void os_tick(void);
 
 void os_burn(uint32_t ticks);
@@ -57,16 +143,68 @@ void os_delay(uint32_t ticks);
 void os_yield(void);
 void os_exit(void);
 
+os_time_t os_current_ticks(void);
 uint32_t os_current_millis(void);
+uint64_t os_current_micros(void);
+
+#if defined(OS_STATS)
+	// Size of each thread record written by os_dump_stats()
+	#define OS_STATS_RECORD_SIZE 25
+
+	void os_get_stats(const thread_t* thread, os_thread_stats_t* stats);
+	uint32_t os_dump_stats(uint8_t* buffer, uint32_t size);
+#endif
 
 /*
  * Semaphore
  */
-typedef struct {
+typedef struct semaphore {
 	uint32_t maximum_value;
 	uint32_t current_value;
+	thread_t* waiters; // Blocked threads, earliest absolute deadline first
 } semaphore_t;
 
 void semaphore_init(semaphore_t* semaphore, uint32_t maximum_value, uint32_t starting_value);
 void semaphore_wait(semaphore_t* semaphore);
+// Returns false if the semaphore couldn't be taken within the given ticks
+bool semaphore_wait_timeout(semaphore_t* semaphore, uint32_t ticks);
 void semaphore_signal(semaphore_t* semaphore);
+
+/*
+ * Resource
+ */
+// Resources are shared under the Stack Resource Policy (SRP). A thread's
+// preemption level is higher the shorter its relative deadline, and a
+// resource's ceiling is the highest preemption level among its users, which
+// must be declared with resource_use() before the threads start.
+typedef struct {
+	uint32_t ceiling; // Shortest relative deadline among the users
+	uint32_t previous_system_ceiling;
+	thread_t* owner;
+} resource_t;
+
+void resource_init(resource_t* resource);
+void resource_use(resource_t* resource, const thread_t* thread);
+void resource_lock(resource_t* resource);
+void resource_unlock(resource_t* resource);
+
+/*
+ * Trace
+ */
+// Event records sent by the kernel over USART1 when compiled with OS_TRACE
+#define OS_TRACE_MAGIC 0xA5
+
+typedef enum {
+	OS_TRACE_SWITCH_IN, // The thread starts running
+	OS_TRACE_SWITCH_OUT, // The thread stops running
+	OS_TRACE_RELEASE, // The thread's job is released, or its delay is over
+	OS_TRACE_DEADLINE_MISS, // The thread's job completed after its deadline
+	OS_TRACE_APERIODIC_ENQUEUE, // The server is activated for a request, argument is the number of queued requests
+	OS_TRACE_SEMAPHORE_WAIT, // Argument is 1 if the thread blocked
+	OS_TRACE_SEMAPHORE_SIGNAL, // Argument is 1 if the thread was handed the semaphore
+} os_trace_event_t;
+
+#if defined(OS_TRACE)
+	// Number of events lost because the trace buffer was full
+	uint32_t os_trace_dropped(void);
+#endif
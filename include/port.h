@@ -0,0 +1,154 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "miros.h"
+
+// Everything the kernel needs from the processor it runs on. src/port.c is the
+// Cortex-M3 port, and host/port.c runs the kernel as a Linux process, in
+// virtual time, when compiled with PORT_HOST.
+
+/*
+ * Kernel hooks
+ */
+// The running thread, NULL until the first switch
+extern thread_t* os_thread_current;
+
+// Must be called by the port, in a critical section, every time it switches
+// threads, after saving the context of os_thread_current. It makes the thread
+// picked by the kernel current.
+void os_thread_switch(void);
+
+#if defined(OS_TRACE)
+	// Must be called by the port once port_trace_send() is done
+	void os_trace_sent(void);
+#endif
+
+/*
+ * Critical sections
+ */
+// Kernel state is only touched with the interrupts that may call into the
+// kernel masked. Critical sections nest: port_enter_critical() returns what
+// the matching port_exit_critical() restores.
+typedef uint32_t port_critical_t;
+
+#if defined(PORT_HOST)
+	port_critical_t port_enter_critical(void);
+	void port_exit_critical(port_critical_t previous);
+#else
+	// Priority of the kernel, of SysTick and of every interrupt that calls into
+	// the kernel, out of the 16 levels of the STM32F103. Interrupts given a
+	// higher priority, that is a lower number, are never masked by the kernel
+	// and must not call into it.
+	#if !defined(PORT_KERNEL_PRIORITY)
+		#define PORT_KERNEL_PRIORITY 4
+	#endif
+	_Static_assert(PORT_KERNEL_PRIORITY > 0 && PORT_KERNEL_PRIORITY < 15, "the kernel priority must leave room above it, and for PendSV below it");
+	// Priority as BASEPRI holds it, in its upper 4 bits
+	#define PORT_KERNEL_BASEPRI (PORT_KERNEL_PRIORITY << 4)
+
+	__attribute__((always_inline)) static inline port_critical_t port_enter_critical(void) {
+		port_critical_t previous;
+		asm volatile ("mrs %0, basepri" : "=r" (previous));
+		// Only raises the mask, so nested sections keep the outer one's
+		asm volatile ("msr basepri_max, %0" : : "r" (PORT_KERNEL_BASEPRI) : "memory");
+		return previous;
+	}
+
+	__attribute__((always_inline)) static inline void port_exit_critical(port_critical_t previous) {
+		asm volatile ("msr basepri, %0" : : "r" (previous) : "memory");
+	}
+#endif
+
+/*
+ * Atomics
+ */
+// Lock-free read-modify-write of a word shared with interrupts of any priority:
+// port_store_exclusive() only stores, and returns true, if nothing else stored
+// to the word, and no interrupt came, since port_load_exclusive(). A loaded
+// word that is not stored to must be let go with port_clear_exclusive().
+#if defined(PORT_HOST)
+	uint32_t port_load_exclusive(volatile uint32_t* address);
+	bool port_store_exclusive(volatile uint32_t* address, uint32_t value);
+	void port_clear_exclusive(void);
+	void port_memory_barrier(void);
+#else
+	__attribute__((always_inline)) static inline uint32_t port_load_exclusive(volatile uint32_t* address) {
+		uint32_t value;
+		asm volatile ("ldrex %0, [%1]" : "=r" (value) : "r" (address) : "memory");
+		return value;
+	}
+
+	__attribute__((always_inline)) static inline bool port_store_exclusive(volatile uint32_t* address, uint32_t value) {
+		uint32_t failed;
+		asm volatile ("strex %0, %2, [%1]" : "=&r" (failed) : "r" (address), "r" (value) : "memory");
+		return !failed;
+	}
+
+	__attribute__((always_inline)) static inline void port_clear_exclusive(void) {
+		asm volatile ("clrex" : : : "memory");
+	}
+
+	// Make the stores before it visible before the stores after it
+	__attribute__((always_inline)) static inline void port_memory_barrier(void) {
+		asm volatile ("dmb" : : : "memory");
+	}
+#endif
+
+/*
+ * Threads
+ */
+void port_init(void);
+// Prepare the thread to run its entry point, and then os_exit(), when it is
+// switched to for the first time
+void port_thread_init(thread_t* thread);
+// Switch to the thread picked by the kernel as soon as the outermost critical
+// section is left
+void port_request_switch(void);
+// Run the current thread's entry point again from the top of its stack
+__attribute__((noreturn)) void port_thread_restart(thread_t* thread);
+// Called by the idle thread in a loop
+void port_idle(void);
+// Called in a loop while a thread waits for time to pass
+void port_spin(void);
+
+/*
+ * Tick timer
+ */
+// A down-counter clocked by the core clock that raises the tick interrupt, in
+// which the port calls os_tick(), when it wraps, and starts over from its
+// reload value
+#define PORT_TIMER_RELOAD_MAX 0x00FFFFFF
+
+void port_timer_init(uint32_t cycles);
+uint32_t port_timer_count(void);
+uint32_t port_timer_reload(void);
+// Restart the count from the given reload value
+void port_timer_restart(uint32_t reload);
+// Leave the count alone and take the given reload value from its next wrap on
+void port_timer_set_reload(uint32_t reload);
+// Whether the counter wrapped and the tick interrupt has not been taken yet
+bool port_timer_pending(void);
+void port_timer_clear_pending(void);
+
+/*
+ * Clock
+ */
+uint32_t port_clock(void);
+// Free-running core clock cycle counter
+uint32_t port_cycles(void);
+
+/*
+ * Instrumentation
+ */
+#if defined(OS_DEBUG_GPIO)
+	// Show on a pin whether the thread runs
+	void port_debug_init(uint8_t id);
+	void port_debug_set(uint8_t id, bool running);
+#endif
+
+#if defined(OS_TRACE)
+	// Start sending size bytes of trace records in the background
+	void port_trace_send(const void* data, uint32_t size);
+#endif
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Serial port
+ */
+// Interrupt and DMA driven driver for USART1. Writes are copied into a ring
+// buffer and sent in the background, and reads block the calling thread until
+// data arrives. When compiled with OS_TRACE, the kernel trace owns USART1's
+// transmitter: writes are discarded and serial_init() must be called after
+// os_init().
+void serial_init(uint32_t baud_rate);
+
+// Queue up to size bytes for sending without blocking, returning how many fit
+uint32_t serial_write(const void* data, uint32_t size);
+
+// Number of received bytes waiting to be read
+uint32_t serial_available(void);
+
+// Block until at least one byte is received, then read up to size bytes.
+// Must be called from a thread.
+uint32_t serial_read(void* data, uint32_t size);
+
+// Number of received bytes lost because the reader fell behind
+uint32_t serial_overruns(void);
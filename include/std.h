@@ -23,5 +23,7 @@ char* std_itoa(int n, char* buffer, int base);
 /*
  * string.h
  */
+int std_memcmp(const void* s1, const void* s2, size_t n);
+void* std_memset(void* s, int c, size_t n);
 size_t std_strlen(const char* s);
 char* std_strrev(char* s);
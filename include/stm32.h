@@ -3,6 +3,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "hal.h"
+
 /*
  * ARMv7
  */
@@ -18,6 +20,8 @@ __attribute__((always_inline)) static inline void __enable_irq(void) {
  * Cortex-M3
  */
 // Nested vectored interrupt controller (NVIC)
+#define NVIC_IRQ_COUNT 43 // Of the medium-density STM32F103
+
 struct nvic {
 	volatile uint32_t iser[1]; // Interrupt set enable register
 	uint32_t reserved0[31];
@@ -28,7 +32,7 @@ struct nvic {
 	volatile uint32_t icpr[1]; // Interrupt clear pending register
 	uint32_t reserved3[31];
 	uint32_t reserved4[64];
-	volatile uint32_t ip[1]; // Interrupt priority
+	volatile uint8_t ip[NVIC_IRQ_COUNT]; // Interrupt priority
 };
 
 #define NVIC ((struct nvic*) 0xE000E100)
@@ -36,7 +40,14 @@ struct nvic {
 typedef enum {
 	IRQN_PENDSV = -2,
 	IRQN_SYSTICK = -1,
+	IRQN_EXTI0 = 6,
+	IRQN_DMA1_CHANNEL4 = 14,
+	IRQN_DMA1_CHANNEL5 = 15,
+	IRQN_DMA1_CHANNEL7 = 17,
 	IRQN_EXTI9_5 = 23,
+	IRQN_I2C1_EV = 31,
+	IRQN_I2C1_ER = 32,
+	IRQN_USART1 = 37,
 } IRQN;
 
 #define NVIC_PRIO_BITS 4
@@ -59,6 +70,8 @@ struct scb {
 
 #define SCB ((struct scb*) 0xE000ED00)
 
+#define SCB_ICSR_PENDSTCLR (1 << 25)
+#define SCB_ICSR_PENDSTSET (1 << 26)
 #define SCB_ICSR_PENDSVSET (1 << 28)
 
 // SysTick
@@ -75,9 +88,35 @@ struct systick {
 #define	SYSTICK_CSR_TICKINT (1 << 1)
 #define	SYSTICK_CSR_CLKSOURCE (1 << 2)
 
+#define SYSTICK_RVR_MAX 0x00FFFFFF
+
 extern void systick_handler(void);
 void systick_init(uint32_t ticks);
 
+// Core debug
+struct core_debug {
+	volatile uint32_t dhcsr; // Debug Halting Control and Status Register
+	volatile uint32_t dcrsr; // Debug Core Register Selector Register
+	volatile uint32_t dcrdr; // Debug Core Register Data Register
+	volatile uint32_t demcr; // Debug Exception and Monitor Control Register
+};
+
+#define CORE_DEBUG ((struct core_debug*) 0xE000EDF0)
+
+#define CORE_DEBUG_DEMCR_TRCENA (1 << 24)
+
+// Data watchpoint and trace (DWT)
+struct dwt {
+	volatile uint32_t ctrl; // Control Register
+	volatile uint32_t cyccnt; // Cycle Count Register
+};
+
+#define DWT ((struct dwt*) 0xE0001000)
+
+#define DWT_CTRL_CYCCNTENA (1 << 0)
+
+void dwt_init(void);
+
 /*
  * STM32F103
  */
@@ -99,6 +138,26 @@ struct flash {
 #define FLASH_ACR_LATENCY(x) ((x) << 0)
 #define FLASH_ACR_PRFTBE (1 << 4)
 
+#define FLASH_KEY1 0x45670123
+#define FLASH_KEY2 0xCDEF89AB
+
+#define FLASH_SR_BSY (1 << 0) // Busy
+#define FLASH_SR_PGERR (1 << 2) // Programming error
+#define FLASH_SR_WRPRTERR (1 << 4) // Write protection error
+#define FLASH_SR_EOP (1 << 5) // End of operation
+
+#define FLASH_CR_PG (1 << 0) // Programming
+#define FLASH_CR_PER (1 << 1) // Page erase
+#define FLASH_CR_STRT (1 << 6) // Start
+#define FLASH_CR_LOCK (1 << 7) // Lock
+
+#define FLASH_PAGE_SIZE 1024
+
+void flash_unlock(void);
+void flash_lock(void);
+bool flash_erase_page(uint32_t address);
+bool flash_program(uint32_t address, const void* data, uint32_t size);
+
 // Reset and Clock Control (RCC)
 struct rcc {
 	volatile uint32_t cr; // Clock control register
@@ -128,6 +187,8 @@ struct rcc {
 
 #define RCC_APB1RSTR_I2C1RST (1 << 21)
 
+#define RCC_AHBENR_DMA1EN (1 << 0)
+
 #define RCC_APB2ENR_AFIOEN (1 << 0)
 #define RCC_APB2ENR_IOPAEN (1 << 2)
 #define RCC_APB2ENR_IOPBEN (1 << 3)
@@ -141,6 +202,42 @@ struct rcc {
 void rcc_init(void);
 uint32_t rcc_get_clock(void);
 
+// Direct memory access controller (DMA)
+struct dma_channel {
+	volatile uint32_t ccr; // Channel configuration register
+	volatile uint32_t cndtr; // Channel number of data register
+	volatile uint32_t cpar; // Channel peripheral address register
+	volatile uint32_t cmar; // Channel memory address register
+	uint32_t reserved;
+};
+
+struct dma {
+	volatile uint32_t isr; // Interrupt status register
+	volatile uint32_t ifcr; // Interrupt flag clear register
+	struct dma_channel channel[7]; // Channels 1 to 7
+};
+
+#define DMA1 ((struct dma*) 0x40020000)
+
+#define DMA_CCR_EN (1 << 0) // Channel enable
+#define DMA_CCR_TCIE (1 << 1) // Transfer complete interrupt enable
+#define DMA_CCR_HTIE (1 << 2) // Half transfer interrupt enable
+#define DMA_CCR_TEIE (1 << 3) // Transfer error interrupt enable
+#define DMA_CCR_DIR (1 << 4) // Read from memory
+#define DMA_CCR_CIRC (1 << 5) // Circular mode
+#define DMA_CCR_MINC (1 << 7) // Memory increment mode
+
+#define DMA_ISR_GIF(channel) (1 << (4 * ((channel) - 1) + 0)) // Global interrupt flag
+#define DMA_ISR_TCIF(channel) (1 << (4 * ((channel) - 1) + 1)) // Transfer complete flag
+#define DMA_ISR_HTIF(channel) (1 << (4 * ((channel) - 1) + 2)) // Half transfer flag
+#define DMA_ISR_TEIF(channel) (1 << (4 * ((channel) - 1) + 3)) // Transfer error flag
+
+void dma_init(struct dma* dma);
+void dma_start(struct dma* dma, uint8_t channel, volatile void* peripheral, const volatile void* memory, uint16_t count, uint32_t ccr);
+void dma_stop(struct dma* dma, uint8_t channel);
+uint16_t dma_remaining(struct dma* dma, uint8_t channel);
+void dma_clear_flags(struct dma* dma, uint8_t channel);
+
 // External interrupt event controller (EXTI)
 struct exti {
 	volatile uint32_t imr; // Interrupt mask register
@@ -212,8 +309,14 @@ struct i2c {
 #define I2C_CR1_STOP (1 << 9)
 #define I2C_CR1_ACK (1 << 10)
 #define I2C_CR1_POS (1 << 11)
+#define I2C_CR1_SWRST (1 << 15)
 
 #define I2C_CR2_FREQ(x) ((x) & 0b111111)
+#define I2C_CR2_ITERREN (1 << 8) // Error interrupt enable
+#define I2C_CR2_ITEVTEN (1 << 9) // Event interrupt enable
+#define I2C_CR2_ITBUFEN (1 << 10) // Buffer interrupt enable
+#define I2C_CR2_DMAEN (1 << 11) // DMA requests enable
+#define I2C_CR2_LAST (1 << 12) // DMA last transfer
 
 #define I2C_SR1_SB (1 << 0)
 #define I2C_SR1_ADDR (1 << 1)
@@ -232,6 +335,10 @@ void i2c_init(struct i2c* i2c);
 void i2c_read(struct i2c* i2c, uint8_t slave_address, uint8_t* data, uint8_t size);
 void i2c_write(struct i2c* i2c, uint8_t slave_address, uint8_t* data, uint8_t size);
 
+// Asynchronous transfers, only on I2C1, see struct i2c_transfer in hal.h
+bool i2c_start(struct i2c* i2c, struct i2c_transfer* transfer);
+void i2c_abort(struct i2c* i2c);
+
 // Timer
 struct timer {
 	volatile uint32_t cr1; // Control register 1
@@ -283,15 +390,20 @@ struct usart {
 #define USART2 ((struct usart*) 0x40004400)
 #define USART3 ((struct usart*) 0x40004800)
 
+#define USART_SR_IDLE (1 << 4) // IDLE line detected
 #define USART_SR_RXNE (1 << 5) // Read data register not empty
 #define USART_SR_TXE (1 << 7) // Transmit data register empty
 
 #define USART_CR1_RE (1 << 2) // Receiver enable
 #define USART_CR1_TE (1 << 3) // Transmitter enable
+#define USART_CR1_IDLEIE (1 << 4) // IDLE interrupt enable
 #define USART_CR1_PCE (1 << 10) // Parity control enable
 #define USART_CR1_M (1 << 12) // Word length
 #define USART_CR1_UE (1 << 13) // USART enable
 
+#define USART_CR3_DMAR (1 << 6) // DMA enable receiver
+#define USART_CR3_DMAT (1 << 7) // DMA enable transmitter
+
 void usart_init(struct usart* usart, uint32_t brr);
 void usart_write(struct usart* usart, char c);
 char usart_read(struct usart* usart);
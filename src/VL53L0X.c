@@ -6,9 +6,11 @@
 #include "VL53L0X.h"
 
 // Defines /////////////////////////////////////////////////////////////////////
+#include "bus.h"
 #include "miros.h"
 #include "std.h"
-#include "stm32.h"
+#include "hal.h"
+#include "port.h"
 
 // Record the current time to check an upcoming timeout against
 //#define startTimeout() (timeout_start_ms = millis())
@@ -32,12 +34,420 @@
 
 
 
+// Keep the bus status of the last transfer in last_status, and report bus
+// timeouts like sensor timeouts, through VL53L0X_timeoutOccurred()
+static void VL53L0X_checkStatus(struct VL53L0X* dev, bus_status_t status)
+{
+  dev->last_status = status;
+  if (status == BUS_TIMEOUT)
+  {
+    dev->did_timeout = true;
+  }
+}
+
+// Register sequences ////////////////////////////////////////////////////////
+// Each one runs as a single bus job, see bus_run_script()
+
+// "Set I2C standard mode", then read the stop variable from 0x91
+static const bus_op_t VL53L0X_initScript[] = {
+  BUS_WRITE(0x88, 0x00),
+  BUS_WRITE(0x80, 0x01),
+  BUS_WRITE(0xFF, 0x01),
+  BUS_WRITE(0x00, 0x00),
+  BUS_READ(0x91, 1),
+  BUS_WRITE(0x00, 0x01),
+  BUS_WRITE(0xFF, 0x00),
+  BUS_WRITE(0x80, 0x00),
+  BUS_END
+};
+
+// Write the stop variable, passed as args[0], before starting a measurement
+#define VL53L0X_STOP_VARIABLE_OPS \
+  BUS_WRITE(0x80, 0x01), \
+  BUS_WRITE(0xFF, 0x01), \
+  BUS_WRITE(0x00, 0x00), \
+  BUS_WRITE_ARG(0x91, 0), \
+  BUS_WRITE(0x00, 0x01), \
+  BUS_WRITE(0xFF, 0x00), \
+  BUS_WRITE(0x80, 0x00)
+
+static const bus_op_t VL53L0X_stopVariableScript[] = {
+  VL53L0X_STOP_VARIABLE_OPS,
+  BUS_END
+};
+
+static const bus_op_t VL53L0X_singleShotScript[] = {
+  VL53L0X_STOP_VARIABLE_OPS,
+  BUS_WRITE(SYSRANGE_START, 0x01),
+  BUS_END
+};
+
+static const bus_op_t VL53L0X_stopContinuousScript[] = {
+  BUS_WRITE(SYSRANGE_START, 0x01), // VL53L0X_REG_SYSRANGE_MODE_SINGLESHOT
+  BUS_WRITE(0xFF, 0x01),
+  BUS_WRITE(0x00, 0x00),
+  BUS_WRITE(0x91, 0x00),
+  BUS_WRITE(0x00, 0x01),
+  BUS_WRITE(0xFF, 0x00),
+  BUS_END
+};
+
+// Read the range and clear the interrupt
+static const bus_op_t VL53L0X_readRangeScript[] = {
+  BUS_READ(RESULT_RANGE_STATUS + 10, 2),
+  BUS_WRITE(SYSTEM_INTERRUPT_CLEAR, 0x01),
+  BUS_END
+};
+
+// VL53L0X_set_reference_spads(), before writing the SPAD map
+static const bus_op_t VL53L0X_referenceSpadsScript[] = {
+  BUS_WRITE(0xFF, 0x01),
+  BUS_WRITE(DYNAMIC_SPAD_REF_EN_START_OFFSET, 0x00),
+  BUS_WRITE(DYNAMIC_SPAD_NUM_REQUESTED_REF_SPAD, 0x2C),
+  BUS_WRITE(0xFF, 0x00),
+  BUS_WRITE(GLOBAL_CONFIG_REF_EN_START_SELECT, 0xB4),
+  BUS_END
+};
+
+// VL53L0X_ref_calibration_io(): VHV settings and phase calibration, read back
+// after VL53L0X_PerformRefCalibration() or written by VL53L0X_SetRefCalibration()
+#define VL53L0X_REF_CALIBRATION_SCRIPT(...) { \
+  BUS_WRITE(0xFF, 0x01), \
+  BUS_WRITE(0x00, 0x00), \
+  BUS_WRITE(0xFF, 0x00), \
+  __VA_ARGS__, \
+  BUS_WRITE(0xFF, 0x01), \
+  BUS_WRITE(0x00, 0x01), \
+  BUS_WRITE(0xFF, 0x00), \
+  BUS_END \
+}
+
+static const bus_op_t VL53L0X_readRefCalibrationScript[] =
+  VL53L0X_REF_CALIBRATION_SCRIPT(BUS_READ(0xCB, 1), BUS_READ(0xEE, 1));
+
+static const bus_op_t VL53L0X_writeRefCalibrationScript[] =
+  VL53L0X_REF_CALIBRATION_SCRIPT(BUS_WRITE_ARG(0xCB, 0), BUS_WRITE_ARG(0xEE, 1));
+
+// VL53L0X_getSpadInfo() steps, around the read-modify-writes of 0x83
+static const bus_op_t VL53L0X_spadInfoBeginScript[] = {
+  BUS_WRITE(0x80, 0x01),
+  BUS_WRITE(0xFF, 0x01),
+  BUS_WRITE(0x00, 0x00),
+  BUS_WRITE(0xFF, 0x06),
+  BUS_READ(0x83, 1),
+  BUS_END
+};
+
+static const bus_op_t VL53L0X_spadInfoRequestScript[] = {
+  BUS_WRITE(0xFF, 0x07),
+  BUS_WRITE(0x81, 0x01),
+  BUS_WRITE(0x80, 0x01),
+  BUS_WRITE(0x94, 0x6b),
+  BUS_WRITE(0x83, 0x00),
+  BUS_END
+};
+
+static const bus_op_t VL53L0X_spadInfoEndScript[] = {
+  BUS_WRITE(0x81, 0x00),
+  BUS_WRITE(0xFF, 0x06),
+  BUS_READ(0x83, 1),
+  BUS_END
+};
+
+static const bus_op_t VL53L0X_restoreScript[] = {
+  BUS_WRITE(0xFF, 0x01),
+  BUS_WRITE(0x00, 0x01),
+  BUS_WRITE(0xFF, 0x00),
+  BUS_WRITE(0x80, 0x00),
+  BUS_END
+};
+
+// DefaultTuningSettings from vl53l0x_tuning.h
+static const bus_op_t VL53L0X_tuningScript[] = {
+  BUS_WRITE(0xFF, 0x01),
+  BUS_WRITE(0x00, 0x00),
+
+  BUS_WRITE(0xFF, 0x00),
+  BUS_WRITE(0x09, 0x00),
+  BUS_WRITE(0x10, 0x00),
+  BUS_WRITE(0x11, 0x00),
+
+  BUS_WRITE(0x24, 0x01),
+  BUS_WRITE(0x25, 0xFF),
+  BUS_WRITE(0x75, 0x00),
+
+  BUS_WRITE(0xFF, 0x01),
+  BUS_WRITE(0x4E, 0x2C),
+  BUS_WRITE(0x48, 0x00),
+  BUS_WRITE(0x30, 0x20),
+
+  BUS_WRITE(0xFF, 0x00),
+  BUS_WRITE(0x30, 0x09),
+  BUS_WRITE(0x54, 0x00),
+  BUS_WRITE(0x31, 0x04),
+  BUS_WRITE(0x32, 0x03),
+  BUS_WRITE(0x40, 0x83),
+  BUS_WRITE(0x46, 0x25),
+  BUS_WRITE(0x60, 0x00),
+  BUS_WRITE(0x27, 0x00),
+  BUS_WRITE(0x50, 0x06),
+  BUS_WRITE(0x51, 0x00),
+  BUS_WRITE(0x52, 0x96),
+  BUS_WRITE(0x56, 0x08),
+  BUS_WRITE(0x57, 0x30),
+  BUS_WRITE(0x61, 0x00),
+  BUS_WRITE(0x62, 0x00),
+  BUS_WRITE(0x64, 0x00),
+  BUS_WRITE(0x65, 0x00),
+  BUS_WRITE(0x66, 0xA0),
+
+  BUS_WRITE(0xFF, 0x01),
+  BUS_WRITE(0x22, 0x32),
+  BUS_WRITE(0x47, 0x14),
+  BUS_WRITE(0x49, 0xFF),
+  BUS_WRITE(0x4A, 0x00),
+
+  BUS_WRITE(0xFF, 0x00),
+  BUS_WRITE(0x7A, 0x0A),
+  BUS_WRITE(0x7B, 0x00),
+  BUS_WRITE(0x78, 0x21),
+
+  BUS_WRITE(0xFF, 0x01),
+  BUS_WRITE(0x23, 0x34),
+  BUS_WRITE(0x42, 0x00),
+  BUS_WRITE(0x44, 0xFF),
+  BUS_WRITE(0x45, 0x26),
+  BUS_WRITE(0x46, 0x05),
+  BUS_WRITE(0x40, 0x40),
+  BUS_WRITE(0x0E, 0x06),
+  BUS_WRITE(0x20, 0x1A),
+  BUS_WRITE(0x43, 0x40),
+
+  BUS_WRITE(0xFF, 0x00),
+  BUS_WRITE(0x34, 0x03),
+  BUS_WRITE(0x35, 0x44),
+
+  BUS_WRITE(0xFF, 0x01),
+  BUS_WRITE(0x31, 0x04),
+  BUS_WRITE(0x4B, 0x09),
+  BUS_WRITE(0x4C, 0x05),
+  BUS_WRITE(0x4D, 0x04),
+
+  BUS_WRITE(0xFF, 0x00),
+  BUS_WRITE(0x44, 0x00),
+  BUS_WRITE(0x45, 0x20),
+  BUS_WRITE(0x47, 0x08),
+  BUS_WRITE(0x48, 0x28),
+  BUS_WRITE(0x67, 0x00),
+  BUS_WRITE(0x70, 0x04),
+  BUS_WRITE(0x71, 0x01),
+  BUS_WRITE(0x72, 0xFE),
+  BUS_WRITE(0x76, 0x00),
+  BUS_WRITE(0x77, 0x00),
+
+  BUS_WRITE(0xFF, 0x01),
+  BUS_WRITE(0x0D, 0x01),
+
+  BUS_WRITE(0xFF, 0x00),
+  BUS_WRITE(0x80, 0x01),
+  BUS_WRITE(0x01, 0xF8),
+
+  BUS_WRITE(0xFF, 0x01),
+  BUS_WRITE(0x8E, 0x01),
+  BUS_WRITE(0x00, 0x01),
+  BUS_WRITE(0xFF, 0x00),
+  BUS_WRITE(0x80, 0x00),
+
+  BUS_END
+};
+
+// Register shadow /////////////////////////////////////////////////////////////
+// Configuration registers of page 0 that only change when written are kept in
+// struct VL53L0X, written through, so that read-modify-writes and the timing
+// getters don't go to the bus. Every other register (results, interrupt status,
+// SYSRANGE_START, page 1 and above...) is volatile and always read from the
+// sensor. Writes to 0xFF select the page, which is tracked to tell them apart,
+// and the shadow is left alone while the undocumented 0x80 is set, as ST's
+// private sequences do around their accesses to other pages.
+static const uint8_t VL53L0X_shadowRegs[VL53L0X_SHADOW_SIZE] = {
+  SYSTEM_SEQUENCE_CONFIG,
+  FINAL_RANGE_CONFIG_MIN_COUNT_RATE_RTN_LIMIT,
+  FINAL_RANGE_CONFIG_MIN_COUNT_RATE_RTN_LIMIT + 1,
+  MSRC_CONFIG_TIMEOUT_MACROP,
+  PRE_RANGE_CONFIG_VCSEL_PERIOD,
+  PRE_RANGE_CONFIG_TIMEOUT_MACROP_HI,
+  PRE_RANGE_CONFIG_TIMEOUT_MACROP_LO,
+  MSRC_CONFIG_CONTROL,
+  FINAL_RANGE_CONFIG_VCSEL_PERIOD,
+  FINAL_RANGE_CONFIG_TIMEOUT_MACROP_HI,
+  FINAL_RANGE_CONFIG_TIMEOUT_MACROP_LO,
+  GPIO_HV_MUX_ACTIVE_HIGH,
+  VHV_CONFIG_PAD_SCL_SDA__EXTSUP_HV,
+  OSC_CALIBRATE_VAL,
+  OSC_CALIBRATE_VAL + 1,
+};
+
+#define VL53L0X_PAGE_SELECT 0xFF
+#define VL53L0X_PAGE_UNKNOWN 0xFF
+#define VL53L0X_PRIVATE_MODE 0x80
+
+static int8_t VL53L0X_shadowIndex(struct VL53L0X* dev, uint8_t reg)
+{
+  if (dev->page != 0 || dev->private_mode != 0)
+  {
+    return -1;
+  }
+  for (uint8_t i = 0; i < VL53L0X_SHADOW_SIZE; i++)
+  {
+    if (VL53L0X_shadowRegs[i] == reg)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Record count bytes written to or read from the sensor at reg, or forget them
+// if the transfer failed
+static void VL53L0X_shadowWrite(struct VL53L0X* dev, uint8_t reg, const uint8_t* data, uint8_t count, bool ok)
+{
+  for (uint8_t i = 0; i < count; i++)
+  {
+    if ((uint8_t) (reg + i) == VL53L0X_PAGE_SELECT)
+    {
+      dev->page = ok ? data[i] : VL53L0X_PAGE_UNKNOWN;
+      continue;
+    }
+    if ((uint8_t) (reg + i) == VL53L0X_PRIVATE_MODE && dev->page == 0)
+    {
+      dev->private_mode = ok ? data[i] : 0xFF;
+      continue;
+    }
+    int8_t index = VL53L0X_shadowIndex(dev, reg + i);
+    if (index < 0)
+    {
+      continue;
+    }
+    if (ok)
+    {
+      dev->shadow[index] = data[i];
+      dev->shadow_valid |= 1 << index;
+    }
+    else
+    {
+      dev->shadow_valid &= ~(1 << index);
+    }
+  }
+}
+
+// Returns false unless all count bytes at reg are in the shadow
+static bool VL53L0X_shadowRead(struct VL53L0X* dev, uint8_t reg, uint8_t* data, uint8_t count)
+{
+  for (uint8_t i = 0; i < count; i++)
+  {
+    int8_t index = VL53L0X_shadowIndex(dev, reg + i);
+    if (index < 0 || !(dev->shadow_valid & (1 << index)))
+    {
+      return false;
+    }
+    data[i] = dev->shadow[index];
+  }
+  return true;
+}
+
+static void VL53L0X_runScript(struct VL53L0X* dev, const bus_op_t* script, const uint8_t* args, uint8_t* results)
+{
+  VL53L0X_checkStatus(dev, bus_run_script(dev->address, script, args, results));
+
+  // Replay the script on the shadow
+  bool ok = dev->last_status == BUS_OK;
+  uint16_t offset = 0;
+  for (const bus_op_t* op = script; op->type != BUS_OP_END; op++)
+  {
+    if (op->type == BUS_OP_READ)
+    {
+      VL53L0X_shadowWrite(dev, op->reg, &results[offset], op->value, ok);
+      offset += op->value;
+    }
+    else
+    {
+      VL53L0X_shadowWrite(dev, op->reg, op->type == BUS_OP_WRITE_ARG ? &args[op->value] : &op->value, 1, ok);
+    }
+  }
+}
+
+// Wait for the sensor to boot after leaving reset, 1.2 ms at most
+static void VL53L0X_bootDelay(void)
+{
+  if (os_running())
+  {
+    os_delay(OS_MILLIS(2) + 1);
+  }
+  else
+  {
+    for (volatile uint32_t i = 0; i < port_clock() / 4000; i++);
+  }
+}
+
 void VL53L0X_setAddress(struct VL53L0X* dev, uint8_t new_addr)
 {
   VL53L0X_writeReg(dev, I2C_SLAVE_DEVICE_ADDRESS, new_addr & 0x7F);
   dev->address = new_addr;
 }
 
+// Bring up several sensors sharing the bus. They all answer to the default
+// address after reset, so they are all held in reset with their XSHUT pins,
+// then released one at a time, moved to their own address, and initialized.
+bool VL53L0X_initMultiple(struct VL53L0X* devs, uint8_t count)
+{
+  for (uint8_t i = 0; i < count; i++)
+  {
+    hal_pin_output(devs[i].xshut_gpio, devs[i].xshut_pin);
+    hal_pin_write(devs[i].xshut_gpio, devs[i].xshut_pin, false);
+  }
+  VL53L0X_bootDelay();
+
+  bool ok = true;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    struct VL53L0X* dev = &devs[i];
+    uint8_t address = dev->address;
+    hal_pin_write(dev->xshut_gpio, dev->xshut_pin, true);
+    VL53L0X_bootDelay();
+    dev->address = VL53L0X_DEFAULT_ADDRESS;
+    VL53L0X_setAddress(dev, address);
+    ok = VL53L0X_init(dev) && ok;
+  }
+  return ok;
+}
+
+// Start continuous ranging on every sensor, so they all measure at once
+void VL53L0X_startContinuousMultiple(struct VL53L0X* devs, uint8_t count, uint32_t period_ms)
+{
+  for (uint8_t i = 0; i < count; i++)
+  {
+    VL53L0X_startContinuous(&devs[i], period_ms);
+  }
+}
+
+// Wait for a new range from every sensor. They range in parallel and each
+// result is read from the bus as soon as it's ready, so this takes as long as
+// the slowest sensor, not the sum of all. Returns how many are valid; the
+// others are 65535.
+uint8_t VL53L0X_waitRangesMillimeters(struct VL53L0X* devs, uint8_t count, uint16_t* ranges)
+{
+  uint8_t valid = 0;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    ranges[i] = VL53L0X_waitRangeMillimeters(&devs[i]);
+    if (ranges[i] != 65535)
+    {
+      valid++;
+    }
+  }
+  return valid;
+}
+
 // Initialize sensor using sequence based on VL53L0X_DataInit(),
 // VL53L0X_StaticInit(), and VL53L0X_PerformRefCalibration().
 // This function does not perform reference SPAD calibration
@@ -45,11 +455,24 @@ void VL53L0X_setAddress(struct VL53L0X* dev, uint8_t new_addr)
 // is performed by ST on the bare modules; it seems like that should work well
 // enough unless a cover glass is added.
 // If io_2v8 (optional) is true or not given, the sensor is configured for 2V8
-// mode.
+// mode. The bus must have been initialized with bus_init().
 bool VL53L0X_init(struct VL53L0X* dev)
+{
+  return VL53L0X_initCalibrated(dev, NULL);
+}
+
+// Same as VL53L0X_init(), but when calibration is given its SPAD selection and
+// reference calibration are applied instead of being read and measured, which
+// takes two single-shot measurements out of the boot. Either way, the values in
+// use end up in dev->calibration.
+bool VL53L0X_initCalibrated(struct VL53L0X* dev, const struct VL53L0X_calibration* calibration)
 {
   // VL53L0X_DataInit() begin
-  i2c_init(I2C1);
+  dev->page = 0;
+  dev->private_mode = 0;
+  dev->shadow_valid = 0;
+  dev->range_job.status = BUS_OK;
+  semaphore_init(&dev->range_ready, 1, 0);
 
   // sensor uses 1V8 mode for I/O by default; switch to 2V8 mode if necessary
   if (dev->io_2v8)
@@ -57,16 +480,8 @@ bool VL53L0X_init(struct VL53L0X* dev)
     VL53L0X_writeReg(dev, VHV_CONFIG_PAD_SCL_SDA__EXTSUP_HV, VL53L0X_readReg(dev, VHV_CONFIG_PAD_SCL_SDA__EXTSUP_HV) | 0x01 ); // set bit 0
   }
 
-  // "Set I2C standard mode"
-  VL53L0X_writeReg(dev, 0x88, 0x00);
-
-  VL53L0X_writeReg(dev, 0x80, 0x01);
-  VL53L0X_writeReg(dev, 0xFF, 0x01);
-  VL53L0X_writeReg(dev, 0x00, 0x00);
-  dev->stop_variable = VL53L0X_readReg(dev, 0x91);
-  VL53L0X_writeReg(dev, 0x00, 0x01);
-  VL53L0X_writeReg(dev, 0xFF, 0x00);
-  VL53L0X_writeReg(dev, 0x80, 0x00);
+  // "Set I2C standard mode", then read the stop variable
+  VL53L0X_runScript(dev, VL53L0X_initScript, NULL, &dev->stop_variable);
 
   // disable SIGNAL_RATE_MSRC (bit 1) and SIGNAL_RATE_PRE_RANGE (bit 4) limit checks
   VL53L0X_writeReg(dev, MSRC_CONFIG_CONTROL, VL53L0X_readReg(dev,  MSRC_CONFIG_CONTROL) | 0x12);
@@ -80,141 +495,49 @@ bool VL53L0X_init(struct VL53L0X* dev)
 
   // VL53L0X_StaticInit() begin
 
-  uint8_t spad_count;
-  bool spad_type_is_aperture;
-  if (!VL53L0X_getSpadInfo(dev, &spad_count, &spad_type_is_aperture)) { return false; }
+  struct VL53L0X_calibration* cal = &dev->calibration;
+  if (calibration)
+  {
+    *cal = *calibration;
+  }
+  else
+  {
+    if (!VL53L0X_getSpadInfo(dev, &cal->spad_count, &cal->spad_type_is_aperture)) { return false; }
 
-  // The SPAD map (RefGoodSpadMap) is read by VL53L0X_get_info_from_device() in
-  // the API, but the same data seems to be more easily readable from
-  // GLOBAL_CONFIG_SPAD_ENABLES_REF_0 through _6, so read it from there
-  uint8_t ref_spad_map[6];
-  VL53L0X_readMulti(dev, GLOBAL_CONFIG_SPAD_ENABLES_REF_0, ref_spad_map, 6);
+    // The SPAD map (RefGoodSpadMap) is read by VL53L0X_get_info_from_device() in
+    // the API, but the same data seems to be more easily readable from
+    // GLOBAL_CONFIG_SPAD_ENABLES_REF_0 through _6, so read it from there
+    VL53L0X_readMulti(dev, GLOBAL_CONFIG_SPAD_ENABLES_REF_0, cal->ref_spad_map, 6);
+  }
 
   // -- VL53L0X_set_reference_spads() begin (assume NVM values are valid)
 
-  VL53L0X_writeReg(dev, 0xFF, 0x01);
-  VL53L0X_writeReg(dev, DYNAMIC_SPAD_REF_EN_START_OFFSET, 0x00);
-  VL53L0X_writeReg(dev, DYNAMIC_SPAD_NUM_REQUESTED_REF_SPAD, 0x2C);
-  VL53L0X_writeReg(dev, 0xFF, 0x00);
-  VL53L0X_writeReg(dev, GLOBAL_CONFIG_REF_EN_START_SELECT, 0xB4);
+  VL53L0X_runScript(dev, VL53L0X_referenceSpadsScript, NULL, NULL);
 
-  uint8_t first_spad_to_enable = spad_type_is_aperture ? 12 : 0; // 12 is the first aperture spad
+  uint8_t first_spad_to_enable = cal->spad_type_is_aperture ? 12 : 0; // 12 is the first aperture spad
   uint8_t spads_enabled = 0;
 
   for (uint8_t i = 0; i < 48; i++)
   {
-    if (i < first_spad_to_enable || spads_enabled == spad_count)
+    if (i < first_spad_to_enable || spads_enabled == cal->spad_count)
     {
       // This bit is lower than the first one that should be enabled, or
       // (reference_spad_count) bits have already been enabled, so zero this bit
-      ref_spad_map[i / 8] &= ~(1 << (i % 8));
+      cal->ref_spad_map[i / 8] &= ~(1 << (i % 8));
     }
-    else if ((ref_spad_map[i / 8] >> (i % 8)) & 0x1)
+    else if ((cal->ref_spad_map[i / 8] >> (i % 8)) & 0x1)
     {
       spads_enabled++;
     }
   }
 
-  VL53L0X_writeMulti(dev, GLOBAL_CONFIG_SPAD_ENABLES_REF_0, ref_spad_map, 6);
+  VL53L0X_writeMulti(dev, GLOBAL_CONFIG_SPAD_ENABLES_REF_0, cal->ref_spad_map, 6);
 
   // -- VL53L0X_set_reference_spads() end
 
   // -- VL53L0X_load_tuning_settings() begin
-  // DefaultTuningSettings from vl53l0x_tuning.h
-
-  VL53L0X_writeReg(dev, 0xFF, 0x01);
-  VL53L0X_writeReg(dev, 0x00, 0x00);
-
-  VL53L0X_writeReg(dev, 0xFF, 0x00);
-  VL53L0X_writeReg(dev, 0x09, 0x00);
-  VL53L0X_writeReg(dev, 0x10, 0x00);
-  VL53L0X_writeReg(dev, 0x11, 0x00);
-
-  VL53L0X_writeReg(dev, 0x24, 0x01);
-  VL53L0X_writeReg(dev, 0x25, 0xFF);
-  VL53L0X_writeReg(dev, 0x75, 0x00);
-
-  VL53L0X_writeReg(dev, 0xFF, 0x01);
-  VL53L0X_writeReg(dev, 0x4E, 0x2C);
-  VL53L0X_writeReg(dev, 0x48, 0x00);
-  VL53L0X_writeReg(dev, 0x30, 0x20);
-
-  VL53L0X_writeReg(dev, 0xFF, 0x00);
-  VL53L0X_writeReg(dev, 0x30, 0x09);
-  VL53L0X_writeReg(dev, 0x54, 0x00);
-  VL53L0X_writeReg(dev, 0x31, 0x04);
-  VL53L0X_writeReg(dev, 0x32, 0x03);
-  VL53L0X_writeReg(dev, 0x40, 0x83);
-  VL53L0X_writeReg(dev, 0x46, 0x25);
-  VL53L0X_writeReg(dev, 0x60, 0x00);
-  VL53L0X_writeReg(dev, 0x27, 0x00);
-  VL53L0X_writeReg(dev, 0x50, 0x06);
-  VL53L0X_writeReg(dev, 0x51, 0x00);
-  VL53L0X_writeReg(dev, 0x52, 0x96);
-  VL53L0X_writeReg(dev, 0x56, 0x08);
-  VL53L0X_writeReg(dev, 0x57, 0x30);
-  VL53L0X_writeReg(dev, 0x61, 0x00);
-  VL53L0X_writeReg(dev, 0x62, 0x00);
-  VL53L0X_writeReg(dev, 0x64, 0x00);
-  VL53L0X_writeReg(dev, 0x65, 0x00);
-  VL53L0X_writeReg(dev, 0x66, 0xA0);
-
-  VL53L0X_writeReg(dev, 0xFF, 0x01);
-  VL53L0X_writeReg(dev, 0x22, 0x32);
-  VL53L0X_writeReg(dev, 0x47, 0x14);
-  VL53L0X_writeReg(dev, 0x49, 0xFF);
-  VL53L0X_writeReg(dev, 0x4A, 0x00);
-
-  VL53L0X_writeReg(dev, 0xFF, 0x00);
-  VL53L0X_writeReg(dev, 0x7A, 0x0A);
-  VL53L0X_writeReg(dev, 0x7B, 0x00);
-  VL53L0X_writeReg(dev, 0x78, 0x21);
-
-  VL53L0X_writeReg(dev, 0xFF, 0x01);
-  VL53L0X_writeReg(dev, 0x23, 0x34);
-  VL53L0X_writeReg(dev, 0x42, 0x00);
-  VL53L0X_writeReg(dev, 0x44, 0xFF);
-  VL53L0X_writeReg(dev, 0x45, 0x26);
-  VL53L0X_writeReg(dev, 0x46, 0x05);
-  VL53L0X_writeReg(dev, 0x40, 0x40);
-  VL53L0X_writeReg(dev, 0x0E, 0x06);
-  VL53L0X_writeReg(dev, 0x20, 0x1A);
-  VL53L0X_writeReg(dev, 0x43, 0x40);
-
-  VL53L0X_writeReg(dev, 0xFF, 0x00);
-  VL53L0X_writeReg(dev, 0x34, 0x03);
-  VL53L0X_writeReg(dev, 0x35, 0x44);
-
-  VL53L0X_writeReg(dev, 0xFF, 0x01);
-  VL53L0X_writeReg(dev, 0x31, 0x04);
-  VL53L0X_writeReg(dev, 0x4B, 0x09);
-  VL53L0X_writeReg(dev, 0x4C, 0x05);
-  VL53L0X_writeReg(dev, 0x4D, 0x04);
-
-  VL53L0X_writeReg(dev, 0xFF, 0x00);
-  VL53L0X_writeReg(dev, 0x44, 0x00);
-  VL53L0X_writeReg(dev, 0x45, 0x20);
-  VL53L0X_writeReg(dev, 0x47, 0x08);
-  VL53L0X_writeReg(dev, 0x48, 0x28);
-  VL53L0X_writeReg(dev, 0x67, 0x00);
-  VL53L0X_writeReg(dev, 0x70, 0x04);
-  VL53L0X_writeReg(dev, 0x71, 0x01);
-  VL53L0X_writeReg(dev, 0x72, 0xFE);
-  VL53L0X_writeReg(dev, 0x76, 0x00);
-  VL53L0X_writeReg(dev, 0x77, 0x00);
-
-  VL53L0X_writeReg(dev, 0xFF, 0x01);
-  VL53L0X_writeReg(dev, 0x0D, 0x01);
-
-  VL53L0X_writeReg(dev, 0xFF, 0x00);
-  VL53L0X_writeReg(dev, 0x80, 0x01);
-  VL53L0X_writeReg(dev, 0x01, 0xF8);
-
-  VL53L0X_writeReg(dev, 0xFF, 0x01);
-  VL53L0X_writeReg(dev, 0x8E, 0x01);
-  VL53L0X_writeReg(dev, 0x00, 0x01);
-  VL53L0X_writeReg(dev, 0xFF, 0x00);
-  VL53L0X_writeReg(dev, 0x80, 0x00);
+
+  VL53L0X_runScript(dev, VL53L0X_tuningScript, NULL, NULL);
 
   // -- VL53L0X_load_tuning_settings() end
 
@@ -243,6 +566,18 @@ bool VL53L0X_init(struct VL53L0X* dev)
 
   // VL53L0X_StaticInit() end
 
+  uint8_t ref_calibration[2];
+  if (calibration)
+  {
+    // VL53L0X_SetRefCalibration(): only the low 7 bits of each register are
+    // calibration results
+    VL53L0X_runScript(dev, VL53L0X_readRefCalibrationScript, NULL, ref_calibration);
+    ref_calibration[0] = (ref_calibration[0] & 0x80) | cal->vhv_settings;
+    ref_calibration[1] = (ref_calibration[1] & 0x80) | cal->phase_cal;
+    VL53L0X_runScript(dev, VL53L0X_writeRefCalibrationScript, ref_calibration, NULL);
+    return dev->last_status == BUS_OK;
+  }
+
   // VL53L0X_PerformRefCalibration() begin (VL53L0X_perform_ref_calibration())
 
   // -- VL53L0X_perform_vhv_calibration() begin
@@ -264,46 +599,103 @@ bool VL53L0X_init(struct VL53L0X* dev)
 
   // VL53L0X_PerformRefCalibration() end
 
+  // VL53L0X_GetRefCalibration()
+  VL53L0X_runScript(dev, VL53L0X_readRefCalibrationScript, NULL, ref_calibration);
+  cal->vhv_settings = ref_calibration[0] & 0x7F;
+  cal->phase_cal = ref_calibration[1] & 0x7F;
+
+  return dev->last_status == BUS_OK;
+}
+
+// Calibration blob kept in the storage page, the last flash page on the STM32
+#define VL53L0X_CALIBRATION_MAGIC 0x4C414356 // "VCAL"
+
+struct VL53L0X_calibrationBlob
+{
+  uint32_t magic;
+  uint32_t count;
+  struct VL53L0X_calibration calibrations[VL53L0X_CALIBRATION_MAX];
+  uint32_t crc; // Of everything above
+};
+
+// CRC-32 (IEEE 802.3), bitwise since it only runs at boot
+static uint32_t VL53L0X_crc32(const void* data, uint32_t size)
+{
+  const uint8_t* bytes = data;
+  uint32_t crc = 0xFFFFFFFF;
+  for (uint32_t i = 0; i < size; i++)
+  {
+    crc ^= bytes[i];
+    for (uint8_t bit = 0; bit < 8; bit++)
+    {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+// Write the calibration found by init for count sensors to flash, replacing
+// whatever was saved before. Must not run while threads have deadlines, as the
+// CPU stalls for the page erase (20 ms at most).
+bool VL53L0X_saveCalibration(struct VL53L0X* devs, uint8_t count)
+{
+  if (count > VL53L0X_CALIBRATION_MAX) { return false; }
+
+  struct VL53L0X_calibrationBlob blob;
+  std_memset(&blob, 0xFF, sizeof(blob));
+  blob.magic = VL53L0X_CALIBRATION_MAGIC;
+  blob.count = count;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    blob.calibrations[i] = devs[i].calibration;
+  }
+  blob.crc = VL53L0X_crc32(&blob, offsetof(struct VL53L0X_calibrationBlob, crc));
+
+  return hal_storage_write(&blob, sizeof(blob));
+}
+
+// Fetch the saved calibration of the sensor at index, as passed to
+// VL53L0X_saveCalibration(). Fails if nothing valid was saved for it.
+bool VL53L0X_loadCalibration(uint8_t index, struct VL53L0X_calibration* calibration)
+{
+  const struct VL53L0X_calibrationBlob* blob = hal_storage();
+  if (blob->magic != VL53L0X_CALIBRATION_MAGIC || index >= blob->count || blob->count > VL53L0X_CALIBRATION_MAX) { return false; }
+  if (blob->crc != VL53L0X_crc32(blob, offsetof(struct VL53L0X_calibrationBlob, crc))) { return false; }
+  *calibration = blob->calibrations[index];
   return true;
 }
 
 // Write an 8-bit register
 void VL53L0X_writeReg(struct VL53L0X* dev, uint8_t reg, uint8_t value)
 {
-	uint8_t buf[2];
-	buf[0] = reg;
-	buf[1] = value;
-	i2c_write(I2C1, 0b0101001, buf, 2);
+  VL53L0X_writeMulti(dev, reg, &value, 1);
 }
 
 // Write a 16-bit register
 void VL53L0X_writeReg16Bit(struct VL53L0X* dev, uint8_t reg, uint16_t value)
 {
-	uint8_t buf[3];
-	buf[0] = reg;
-	buf[1] = (uint8_t) (value >> 8);
-	buf[2] = (uint8_t) (value & 0xFF);
-	i2c_write(I2C1, 0b0101001, buf, 3);
+	uint8_t buf[2];
+	buf[0] = (uint8_t) (value >> 8);
+	buf[1] = (uint8_t) (value & 0xFF);
+	VL53L0X_writeMulti(dev, reg, buf, 2);
 }
 
 // Write a 32-bit register
 void VL53L0X_writeReg32Bit(struct VL53L0X* dev, uint8_t reg, uint32_t value)
 {
-	uint8_t buf[5];
-	buf[0] = reg;
-	buf[1] = (uint8_t) (value >> 24);
-	buf[2] = (uint8_t) (value >> 16);
-	buf[3] = (uint8_t) (value >> 8);
-	buf[4] = (uint8_t) (value & 0xFF);
-	i2c_write(I2C1, 0b0101001, buf, 5);
+	uint8_t buf[4];
+	buf[0] = (uint8_t) (value >> 24);
+	buf[1] = (uint8_t) (value >> 16);
+	buf[2] = (uint8_t) (value >> 8);
+	buf[3] = (uint8_t) (value & 0xFF);
+	VL53L0X_writeMulti(dev, reg, buf, 4);
 }
 
 // Read an 8-bit register
 uint8_t VL53L0X_readReg(struct VL53L0X* dev, uint8_t reg)
 {
-  uint8_t value;
-  i2c_write(I2C1, 0b0101001, &reg, 1);
-  i2c_read(I2C1, 0b0101001, &value, 1);
+  uint8_t value = 0;
+  VL53L0X_readMulti(dev, reg, &value, 1);
   return value;
 }
 
@@ -311,9 +703,8 @@ uint8_t VL53L0X_readReg(struct VL53L0X* dev, uint8_t reg)
 uint16_t VL53L0X_readReg16Bit(struct VL53L0X* dev, uint8_t reg)
 {
   uint16_t value;
-  uint8_t buf[2];
-  i2c_write(I2C1, 0b0101001, &reg, 1);
-  i2c_read(I2C1, 0b0101001, buf, 2);
+  uint8_t buf[2] = {0};
+  VL53L0X_readMulti(dev, reg, buf, 2);
   value = (uint16_t) (buf[0] << 8);
   value |= (uint16_t) buf[1];
   return value;
@@ -323,9 +714,8 @@ uint16_t VL53L0X_readReg16Bit(struct VL53L0X* dev, uint8_t reg)
 uint32_t VL53L0X_readReg32Bit(struct VL53L0X* dev, uint8_t reg)
 {
   uint32_t value;
-  uint8_t buf[4];
-  i2c_write(I2C1, 0b0101001, &reg, 1);
-  i2c_read(I2C1, 0b0101001, buf, 4);
+  uint8_t buf[4] = {0};
+  VL53L0X_readMulti(dev, reg, buf, 4);
   value = (uint32_t) ( buf[0] << 24 );
   value |= (uint32_t) ( buf[1] << 16 );
   value |= (uint32_t) ( buf[2] << 8 );
@@ -334,19 +724,27 @@ uint32_t VL53L0X_readReg32Bit(struct VL53L0X* dev, uint8_t reg)
 }
 
 // Write an arbitrary number of bytes from the given array to the sensor,
-// starting at the given register
+// starting at the given register. The register index and the data must go in
+// the same transaction, so count is limited to VL53L0X_MULTI_MAX.
 void VL53L0X_writeMulti(struct VL53L0X* dev, uint8_t reg, uint8_t* src, uint8_t count)
 {
-	i2c_write(I2C1, 0b0101001, &reg, 1);
-	i2c_write(I2C1, 0b0101001, src, count);
+	uint8_t buf[1 + VL53L0X_MULTI_MAX];
+	OS_ASSERT(count <= VL53L0X_MULTI_MAX);
+	buf[0] = reg;
+	for (uint8_t i = 0; i < count; i++)
+		buf[1 + i] = src[i];
+	VL53L0X_checkStatus(dev, bus_write(dev->address, buf, 1 + count));
+	VL53L0X_shadowWrite(dev, reg, src, count, dev->last_status == BUS_OK);
 }
 
 // Read an arbitrary number of bytes from the sensor, starting at the given
-// register, into the given array
+// register, into the given array. Shadowed registers don't go to the bus.
 void VL53L0X_readMulti(struct VL53L0X* dev, uint8_t reg, uint8_t * dst, uint8_t count)
 {
-	i2c_write(I2C1, 0b0101001, &reg, 1);
-	i2c_read(I2C1, 0b0101001, dst, count);
+	if (VL53L0X_shadowRead(dev, reg, dst, count))
+		return;
+	VL53L0X_checkStatus(dev, bus_write_read(dev->address, &reg, 1, dst, count));
+	VL53L0X_shadowWrite(dev, reg, dst, count, dev->last_status == BUS_OK);
 }
 
 // Set the return signal rate limit check value in units of MCPS (mega counts
@@ -709,13 +1107,7 @@ uint8_t VL53L0X_getVcselPulsePeriod(struct VL53L0X* dev, enum VL53L0X_vcselPerio
 // based on VL53L0X_StartMeasurement()
 void VL53L0X_startContinuous(struct VL53L0X* dev, uint32_t period_ms)
 {
-  VL53L0X_writeReg(dev, 0x80, 0x01);
-  VL53L0X_writeReg(dev, 0xFF, 0x01);
-  VL53L0X_writeReg(dev, 0x00, 0x00);
-  VL53L0X_writeReg(dev, 0x91, dev->stop_variable);
-  VL53L0X_writeReg(dev, 0x00, 0x01);
-  VL53L0X_writeReg(dev, 0xFF, 0x00);
-  VL53L0X_writeReg(dev, 0x80, 0x00);
+  VL53L0X_runScript(dev, VL53L0X_stopVariableScript, &dev->stop_variable, NULL);
 
   if (period_ms != 0)
   {
@@ -747,13 +1139,7 @@ void VL53L0X_startContinuous(struct VL53L0X* dev, uint32_t period_ms)
 // based on VL53L0X_StopMeasurement()
 void VL53L0X_stopContinuous(struct VL53L0X* dev)
 {
-  VL53L0X_writeReg(dev, SYSRANGE_START, 0x01); // VL53L0X_REG_SYSRANGE_MODE_SINGLESHOT
-
-  VL53L0X_writeReg(dev, 0xFF, 0x01);
-  VL53L0X_writeReg(dev, 0x00, 0x00);
-  VL53L0X_writeReg(dev, 0x91, 0x00);
-  VL53L0X_writeReg(dev, 0x00, 0x01);
-  VL53L0X_writeReg(dev, 0xFF, 0x00);
+  VL53L0X_runScript(dev, VL53L0X_stopContinuousScript, NULL, NULL);
 }
 
 // Returns a range reading in millimeters when continuous mode is active
@@ -773,11 +1159,58 @@ uint16_t VL53L0X_readRangeContinuousMillimeters(struct VL53L0X* dev)
 
   // assumptions: Linearity Corrective Gain is 1000 (default);
   // fractional ranging is not enabled
-  uint16_t range = VL53L0X_readReg16Bit(dev, RESULT_RANGE_STATUS + 10);
+  uint8_t buf[2] = {0xFF, 0xFF};
+  VL53L0X_runScript(dev, VL53L0X_readRangeScript, NULL, buf);
 
-  VL53L0X_writeReg(dev, SYSTEM_INTERRUPT_CLEAR, 0x01);
+  return (uint16_t) (buf[0] << 8) | buf[1];
+}
+
+// Asynchronous ranging: with continuous ranging started, GPIO1 goes low when a
+// measurement is ready. The interrupt handler of the line wired to it calls
+// VL53L0X_dataReady(), which queues the read of the range on the bus without
+// waiting, and VL53L0X_rangeRead() hands it to the waiting thread.
+static void VL53L0X_rangeRead(bus_job_t* job)
+{
+  struct VL53L0X* dev = job->context;
+  dev->last_status = job->status;
+  if (job->status == BUS_OK)
+  {
+    dev->range = (uint16_t) (dev->range_buffer[0] << 8) | dev->range_buffer[1];
+    semaphore_signal(&dev->range_ready);
+  }
+}
 
-  return range;
+void VL53L0X_dataReady(struct VL53L0X* dev)
+{
+  port_critical_t critical = port_enter_critical();
+  // Skip the measurement if the previous one is still being read
+  if (dev->range_job.status != BUS_PENDING)
+  {
+    dev->range_job = (bus_job_t) {
+      .transfer.slave_address = dev->address,
+      .script = VL53L0X_readRangeScript,
+      .results = dev->range_buffer,
+      .callback = VL53L0X_rangeRead,
+      .context = dev,
+    };
+    bus_submit(&dev->range_job);
+  }
+  port_exit_critical(critical);
+}
+
+// Returns the latest range in millimeters that hasn't been returned yet,
+// waiting for the next measurement if there's none
+uint16_t VL53L0X_waitRangeMillimeters(struct VL53L0X* dev)
+{
+  if (!semaphore_wait_timeout(&dev->range_ready, OS_MILLIS(dev->io_timeout)))
+  {
+    // A failed read leaves the interrupt uncleared and GPIO1 low, so there
+    // won't be another falling edge: read it from here to recover
+    dev->did_timeout = true;
+    VL53L0X_dataReady(dev);
+    return 65535;
+  }
+  return dev->range;
 }
 
 // Performs a single-shot range measurement and returns the reading in
@@ -785,15 +1218,7 @@ uint16_t VL53L0X_readRangeContinuousMillimeters(struct VL53L0X* dev)
 // based on VL53L0X_PerformSingleRangingMeasurement()
 uint16_t VL53L0X_readRangeSingleMillimeters(struct VL53L0X* dev)
 {
-  VL53L0X_writeReg(dev, 0x80, 0x01);
-  VL53L0X_writeReg(dev, 0xFF, 0x01);
-  VL53L0X_writeReg(dev, 0x00, 0x00);
-  VL53L0X_writeReg(dev, 0x91, dev->stop_variable);
-  VL53L0X_writeReg(dev, 0x00, 0x01);
-  VL53L0X_writeReg(dev, 0xFF, 0x00);
-  VL53L0X_writeReg(dev, 0x80, 0x00);
-
-  VL53L0X_writeReg(dev, SYSRANGE_START, 0x01);
+  VL53L0X_runScript(dev, VL53L0X_singleShotScript, &dev->stop_variable, NULL);
 
   // "Wait until start bit has been cleared"
   VL53L0X_startTimeout(dev);
@@ -825,19 +1250,9 @@ bool VL53L0X_getSpadInfo(struct VL53L0X* dev, uint8_t * count, bool * type_is_ap
 {
   uint8_t tmp;
 
-  VL53L0X_writeReg(dev, 0x80, 0x01);
-  VL53L0X_writeReg(dev, 0xFF, 0x01);
-  VL53L0X_writeReg(dev, 0x00, 0x00);
-
-  VL53L0X_writeReg(dev, 0xFF, 0x06);
-  VL53L0X_writeReg(dev, 0x83, VL53L0X_readReg(dev,  0x83) | 0x04);
-  VL53L0X_writeReg(dev, 0xFF, 0x07);
-  VL53L0X_writeReg(dev, 0x81, 0x01);
-
-  VL53L0X_writeReg(dev, 0x80, 0x01);
-
-  VL53L0X_writeReg(dev, 0x94, 0x6b);
-  VL53L0X_writeReg(dev, 0x83, 0x00);
+  VL53L0X_runScript(dev, VL53L0X_spadInfoBeginScript, NULL, &tmp);
+  VL53L0X_writeReg(dev, 0x83, tmp | 0x04);
+  VL53L0X_runScript(dev, VL53L0X_spadInfoRequestScript, NULL, NULL);
   VL53L0X_startTimeout(dev);
   while (VL53L0X_readReg(dev,  0x83) == 0x00)
   {
@@ -849,14 +1264,9 @@ bool VL53L0X_getSpadInfo(struct VL53L0X* dev, uint8_t * count, bool * type_is_ap
   *count = tmp & 0x7f;
   *type_is_aperture = (tmp >> 7) & 0x01;
 
-  VL53L0X_writeReg(dev, 0x81, 0x00);
-  VL53L0X_writeReg(dev, 0xFF, 0x06);
-  VL53L0X_writeReg(dev, 0x83, VL53L0X_readReg(dev,  0x83)  & ~0x04);
-  VL53L0X_writeReg(dev, 0xFF, 0x01);
-  VL53L0X_writeReg(dev, 0x00, 0x01);
-
-  VL53L0X_writeReg(dev, 0xFF, 0x00);
-  VL53L0X_writeReg(dev, 0x80, 0x00);
+  VL53L0X_runScript(dev, VL53L0X_spadInfoEndScript, NULL, &tmp);
+  VL53L0X_writeReg(dev, 0x83, tmp & ~0x04);
+  VL53L0X_runScript(dev, VL53L0X_restoreScript, NULL, NULL);
 
   return true;
 }
@@ -0,0 +1,183 @@
+#include "bus.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "miros.h"
+#include "port.h"
+
+// How long a blocking call waits for its job, plus some time for each step of
+// a script, far more than a register access takes at 100 kHz
+#if !defined(BUS_TIMEOUT_TICKS)
+	#define BUS_TIMEOUT_TICKS OS_MILLIS(25)
+#endif
+#define BUS_STEP_TIMEOUT_TICKS OS_MILLIS(1)
+
+static bus_job_t* bus_queue_head;
+static bus_job_t* bus_queue_tail;
+
+// Must be called in a critical section
+static void bus_start_next(void) {
+	if (bus_queue_head != NULL) {
+		// Only fails if someone else is driving the bus behind its back
+		bool started = hal_i2c_start(&bus_queue_head->transfer);
+		OS_ASSERT(started);
+	}
+}
+
+// Set up the transfer for the next step of the script, returning false at its end
+static bool bus_script_next(bus_job_t* job) {
+	const bus_op_t* op = job->script;
+	struct i2c_transfer* transfer = &job->transfer;
+	if (op->type == BUS_OP_END)
+		return false;
+	if (op->type == BUS_OP_READ) {
+		transfer->write_data = &op->reg;
+		transfer->write_size = 1;
+		transfer->read_data = &job->results[job->results_size];
+		transfer->read_size = op->value;
+		job->results_size += op->value;
+		job->script = op + 1;
+		return true;
+	}
+	uint8_t size = 0;
+	job->burst[0] = op->reg;
+	do {
+		job->burst[1 + size++] = op->type == BUS_OP_WRITE_ARG ? job->args[op->value] : op->value;
+		op++;
+	} while (size < BUS_BURST_MAX && (op->type == BUS_OP_WRITE || op->type == BUS_OP_WRITE_ARG) && op->reg == op[-1].reg + 1);
+	transfer->write_data = job->burst;
+	transfer->write_size = 1 + size;
+	transfer->read_data = NULL;
+	transfer->read_size = 0;
+	job->script = op;
+	return true;
+}
+
+static void bus_transfer_done(struct i2c_transfer* transfer) {
+	bus_job_t* job = (bus_job_t*) transfer;
+	// Scripts keep the bus until they are over or fail
+	if (transfer->status == I2C_OK && job->script != NULL && bus_script_next(job)) {
+		bus_start_next();
+		return;
+	}
+	switch (transfer->status) {
+		case I2C_OK: job->status = BUS_OK; break;
+		case I2C_NACK: job->status = BUS_NACK; break;
+		case I2C_ARBITRATION_LOST: job->status = BUS_ARBITRATION_LOST; break;
+		default: job->status = BUS_ERROR; break;
+	}
+	bus_queue_head = job->next;
+	if (bus_queue_head == NULL)
+		bus_queue_tail = NULL;
+	bus_start_next();
+	if (job->callback != NULL)
+		job->callback(job);
+}
+
+void bus_init(void) {
+	hal_i2c_init();
+	bus_queue_head = NULL;
+	bus_queue_tail = NULL;
+}
+
+void bus_submit(bus_job_t* job) {
+	OS_ASSERT(job);
+	job->status = BUS_PENDING;
+	job->transfer.callback = bus_transfer_done;
+	job->next = NULL;
+	if (job->script != NULL) {
+		job->results_size = 0;
+		bool started = bus_script_next(job);
+		OS_ASSERT(started);
+	}
+	port_critical_t critical = port_enter_critical();
+	if (bus_queue_tail != NULL) {
+		bus_queue_tail->next = job;
+		bus_queue_tail = job;
+	} else {
+		bus_queue_head = bus_queue_tail = job;
+		bus_start_next();
+	}
+	port_exit_critical(critical);
+}
+
+void bus_cancel(bus_job_t* job) {
+	port_critical_t critical = port_enter_critical();
+	if (job->status == BUS_PENDING) {
+		bus_job_t* previous = NULL;
+		bus_job_t** link = &bus_queue_head;
+		while (*link != job) {
+			previous = *link;
+			link = &(*link)->next;
+		}
+		*link = job->next;
+		if (bus_queue_tail == job)
+			bus_queue_tail = previous;
+		if (previous == NULL) {
+			hal_i2c_abort();
+			bus_start_next();
+		}
+		job->status = BUS_TIMEOUT;
+	}
+	port_exit_critical(critical);
+}
+
+/*
+ * Blocking calls
+ */
+static void bus_wake(bus_job_t* job) {
+	semaphore_signal(job->context);
+}
+
+static bus_status_t bus_run(bus_job_t* job, uint32_t timeout) {
+	semaphore_t done;
+	semaphore_init(&done, 1, 0);
+	job->callback = bus_wake;
+	job->context = &done;
+	bus_submit(job);
+	if (os_running()) {
+		if (!semaphore_wait_timeout(&done, timeout))
+			bus_cancel(job);
+	} else {
+		// SysTick isn't running yet, so count loop iterations of a few cycles
+		uint32_t spins = timeout * (port_clock() / OS_TICK_RATE_HZ) / 8;
+		while (job->status == BUS_PENDING && spins--);
+		bus_cancel(job);
+	}
+	return job->status;
+}
+
+bus_status_t bus_write(uint8_t slave_address, const uint8_t* data, uint16_t size) {
+	return bus_write_read(slave_address, data, size, NULL, 0);
+}
+
+bus_status_t bus_read(uint8_t slave_address, uint8_t* data, uint16_t size) {
+	return bus_write_read(slave_address, NULL, 0, data, size);
+}
+
+bus_status_t bus_write_read(uint8_t slave_address, const uint8_t* write_data, uint16_t write_size, uint8_t* read_data, uint16_t read_size) {
+	bus_job_t job = {
+		.transfer = {
+			.slave_address = slave_address,
+			.write_data = write_data,
+			.write_size = write_size,
+			.read_data = read_data,
+			.read_size = read_size,
+		},
+	};
+	return bus_run(&job, BUS_TIMEOUT_TICKS);
+}
+
+bus_status_t bus_run_script(uint8_t slave_address, const bus_op_t* script, const uint8_t* args, uint8_t* results) {
+	bus_job_t job = {
+		.transfer.slave_address = slave_address,
+		.script = script,
+		.args = args,
+		.results = results,
+	};
+	uint32_t steps = 0;
+	while (script[steps].type != BUS_OP_END)
+		steps++;
+	return bus_run(&job, BUS_TIMEOUT_TICKS + steps * BUS_STEP_TIMEOUT_TICKS);
+}
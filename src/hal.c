@@ -0,0 +1,84 @@
+#include "hal.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stm32.h"
+
+// STM32F103 backend of the peripheral interface
+
+/*
+ * Pins
+ */
+void hal_pin_output(struct gpio* gpio, uint8_t pin) {
+	gpio_init(gpio);
+	gpio_configure(gpio, pin, GPIO_CR_MODE_OUTPUT_2M, GPIO_CR_CNF_OUTPUT_PUSH_PULL);
+}
+
+// gpio_write() is inverted: true drives the pin low
+void hal_pin_write(struct gpio* gpio, uint8_t pin, bool high) {
+	gpio_write(gpio, pin, !high);
+}
+
+/*
+ * I2C
+ */
+void hal_i2c_init(void) {
+	i2c_init(I2C1);
+}
+
+bool hal_i2c_start(struct i2c_transfer* transfer) {
+	return i2c_start(I2C1, transfer);
+}
+
+void hal_i2c_abort(void) {
+	i2c_abort(I2C1);
+}
+
+/*
+ * PWM
+ */
+// TIM2 channel 2, on pin A1, counting at 1 MHz
+#define HAL_PWM_CLOCK 1000000
+
+void hal_pwm_init(uint32_t frequency) {
+	timer_init(TIMER2);
+	gpio_init(GPIOA);
+	gpio_configure(GPIOA, 1, GPIO_CR_MODE_OUTPUT_50M, GPIO_CR_CNF_OUTPUT_ALT_PUSH_PULL);
+	TIMER2->psc = rcc_get_clock() / HAL_PWM_CLOCK - 1;
+	TIMER2->arr = HAL_PWM_CLOCK / frequency;
+	TIMER2->ccr2 = 0;
+	TIMER2->ccmr1 |= TIMER_CCMR1_OC2M_1 | TIMER_CCMR1_OC2M_2; // PWM mode 1
+	TIMER2->ccer |= TIMER_CCER_CC2E; // enable output compare on OC2 pin
+	TIMER2->cr1 |= TIMER_CR1_CEN; // enable timer
+}
+
+void hal_pwm_write(uint8_t duty_cycle) {
+	TIMER2->ccr2 = TIMER2->arr * duty_cycle / 100;
+}
+
+/*
+ * Storage
+ */
+// The last flash page, kept out of the program by the linker script
+extern const uint8_t _scalibration[];
+
+_Static_assert(HAL_STORAGE_SIZE == FLASH_PAGE_SIZE, "the storage is one flash page");
+
+const void* hal_storage(void) {
+	return _scalibration;
+}
+
+// Erasing and programming stall the CPU, see flash_program()
+bool hal_storage_write(const void* data, uint32_t size) {
+	if (size > HAL_STORAGE_SIZE)
+		return false;
+	uint32_t address = (uint32_t) _scalibration;
+	flash_unlock();
+	bool ok = flash_erase_page(address) && flash_program(address, data, size);
+	flash_lock();
+	const uint8_t* bytes = data;
+	for (uint32_t i = 0; ok && i < size; i++)
+		ok = _scalibration[i] == bytes[i];
+	return ok;
+}
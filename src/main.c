@@ -3,7 +3,7 @@
 #include "VL53L0X.h"
 
 // Sensor
-static struct VL53L0X myTOFsensor = {.io_2v8 = true, .address = 0b0101001, .io_timeout = 500, .did_timeout = false};
+static struct VL53L0X myTOFsensor = {.io_2v8 = true, .address = VL53L0X_DEFAULT_ADDRESS, .io_timeout = 500, .did_timeout = false};
 
 // Controller
 static int CONTROLLER_PERIOD = OS_MILLIS(50);
@@ -17,7 +17,6 @@ static semaphore_t measure_occupied_semaphore, measure_available_semaphore;
 static semaphore_t actuator_occupied_semaphore, actuator_available_semaphore;
 
 // PWM
-static const uint32_t PMW_PRESCALE = 1e6; // Hz
 static const uint32_t PWM_FREQUENCY = 25e3; // Hz
 
 thread_t sensor_thread;
@@ -25,13 +24,13 @@ uint8_t sensor_stack[256] __attribute__ ((aligned(8)));
 void sensor_main(void) {
 	// Wait for the previously measured value to be consumed
 	semaphore_wait(&measure_available_semaphore);
-	// measured_value = VL53L0X_readRangeContinuousMillimeters(&myTOFsensor) - 400;
+	measured_value = VL53L0X_waitRangeMillimeters(&myTOFsensor) - 400;
 	// Signal that the newly measured value is ready
 	semaphore_signal(&measure_occupied_semaphore);
 }
 
 thread_t controller_thread;
-uint8_t controller_stack[256] __attribute__ ((aligned(8)));
+uint8_t controller_stack[192] __attribute__ ((aligned(8)));
 void controller_main(void) {
 	// Use these values to work around floating-point math
 	static int kp = -10; // -0.00010
@@ -71,31 +70,20 @@ void controller_main(void) {
 }
 
 thread_t actuator_thread;
-uint8_t actuator_stack[256] __attribute__ ((aligned(8)));
+uint8_t actuator_stack[192] __attribute__ ((aligned(8)));
 void actuator_main(void) {
 	// Wait for the calculated value to be ready
 	semaphore_wait(&actuator_occupied_semaphore);
-	// TIMER2->ccr2 = TIMER2->arr * duty_cycle / 100;
+	// hal_pwm_write(duty_cycle);
 	// Signal that the calculated value was consumed
 	semaphore_signal(&actuator_available_semaphore);
 }
 
-void change_main(void) {
+// Carries the new reference value and its duty cycle in the request
+void change_main(aperiodic_task_t* change) {
 	gpio_write(GPIOC, 13, true);
-	switch (reference_value) {
-		default:
-			reference_value = 250;
-			TIMER2->ccr2 = TIMER2->arr * 91 / 100;
-			break;
-		case 250:
-			reference_value = 500;
-			TIMER2->ccr2 = TIMER2->arr * 61 / 100;
-			break;
-		case 500:
-			reference_value = 750;
-			TIMER2->ccr2 = TIMER2->arr * 31 / 100;
-			break;
-	}
+	reference_value = change->payload.words[0];
+	hal_pwm_write(change->payload.words[1]);
 	for (int i = 0; i < 500000; i++);
 	gpio_write(GPIOC, 13, false);
 }
@@ -109,35 +97,35 @@ int main(void) {
 	gpio_configure(GPIOC, 13, GPIO_CR_MODE_OUTPUT_50M, GPIO_CR_CNF_OUTPUT_PUSH_PULL);
 	gpio_write(GPIOC, 13, false);
 
-	// Configure button (A8) interrupt
+	// Configure button (A8)
 	gpio_init(GPIOA);
 	gpio_configure(GPIOA, 8, GPIO_CR_MODE_INPUT, GPIO_CR_CNF_INPUT_FLOATING);
 	exti_configure(8, EXTI_TRIGGER_RISING);
-	exti_enable(8);
-	nvic_enable_irq(IRQN_EXTI9_5);
 
-	// Configure TIM2 for PWM output
-	timer_init(TIMER2);
-	gpio_init(GPIOA);
-	gpio_configure(GPIOA, 1, GPIO_CR_MODE_OUTPUT_50M, GPIO_CR_CNF_OUTPUT_ALT_PUSH_PULL);
-	TIMER2->psc = rcc_get_clock() / PMW_PRESCALE - 1;
-	TIMER2->arr = PMW_PRESCALE / PWM_FREQUENCY;
-	TIMER2->ccr2 = TIMER2->arr * 91 / 100;
-	TIMER2->ccmr1 |= TIMER_CCMR1_OC2M_1 | TIMER_CCMR1_OC2M_2; // PWM mode 1
-	TIMER2->ccer |= TIMER_CCER_CC2E; // enable output compare on OC2 pin
-	TIMER2->cr1 |= TIMER_CR1_CEN; // enable timer
-
-	// Configure VL53L0X
-	// usart_init(USART1, rcc_get_clock() / 115200);
-	// VL53L0X_init(&myTOFsensor);
-	// VL53L0X_setMeasurementTimingBudget(&myTOFsensor, 20e3); // 20 ms
-	// VL53L0X_startContinuous(&myTOFsensor, 0);
+	// Configure PWM output (TIM2 on A1)
+	hal_pwm_init(PWM_FREQUENCY);
+	hal_pwm_write(91);
+
+	// Configure VL53L0X, with its GPIO1 data ready output (active low) wired
+	// to pin A0. In back-to-back mode a new measurement is ready every 20 ms,
+	// so the sensor thread seldom has to wait for one.
+	bus_init();
+	// Reuse the reference calibration saved by an earlier boot, or measure and save it
+	struct VL53L0X_calibration calibration;
+	if (VL53L0X_loadCalibration(0, &calibration)) {
+		VL53L0X_initCalibrated(&myTOFsensor, &calibration);
+	} else if (VL53L0X_init(&myTOFsensor)) {
+		VL53L0X_saveCalibration(&myTOFsensor, 1);
+	}
+	VL53L0X_setMeasurementTimingBudget(&myTOFsensor, 20e3); // 20 ms
+	gpio_configure(GPIOA, 0, GPIO_CR_MODE_INPUT, GPIO_CR_CNF_INPUT_FLOATING);
+	exti_configure(0, EXTI_TRIGGER_FALLING);
 
 	// Initialize operating system
-	os_init(5);
-	// 5 for maximum utilization because
-	// 10/50 + 25/50 + 5/50 = 0.8
-	// 1/(1-0.8) = 5
+	// The actuator waits for the controller, which admission control does not
+	// know about, so rather than whatever bandwidth the threads below leave,
+	// give the TBS a share that keeps its deadlines clear of the controller's
+	os_init(OS_SERVER_BANDWIDTH(1, 3));
 
 	// Semaphores
 	semaphore_init(&measure_available_semaphore, 1, 1);
@@ -148,30 +136,47 @@ int main(void) {
 	sensor_thread = (thread_t) {
 		.stack_begin = &sensor_stack[sizeof(sensor_stack)],
 		.entry_point = &sensor_main,
-		.relative_deadline = OS_MILLIS(10),
+		.computation_time = OS_MILLIS(1),
+		.relative_deadline = OS_MILLIS(2),
 		.period = OS_MILLIS(50),
 	};
-	os_add_thread(&sensor_thread);
+	OS_ASSERT(os_add_thread(&sensor_thread));
 
 	controller_thread = (thread_t) {
 		.stack_begin = &controller_stack[sizeof(controller_stack)],
 		.entry_point = &controller_main,
+		.computation_time = OS_MILLIS(1),
 		.relative_deadline = OS_MILLIS(25),
 		.period = OS_MILLIS(50),
 	};
-	os_add_thread(&controller_thread);
+	OS_ASSERT(os_add_thread(&controller_thread));
 
 	actuator_thread = (thread_t) {
 		.stack_begin = &actuator_stack[sizeof(actuator_stack)],
 		.entry_point = &actuator_main,
+		.computation_time = OS_MILLIS(1),
 		.relative_deadline = OS_MILLIS(5),
 		.period = OS_MILLIS(50),
 	};
-	os_add_thread(&actuator_thread);
+	OS_ASSERT(os_add_thread(&actuator_thread));
+
+	// The interrupts call into the kernel, so only enable them once os_init()
+	// has put them at its priority, and start ranging once the data ready
+	// interrupt can catch the first measurement
+	exti_enable(8);
+	nvic_enable_irq(IRQN_EXTI9_5);
+	exti_enable(0);
+	nvic_enable_irq(IRQN_EXTI0);
+	VL53L0X_startContinuous(&myTOFsensor, 0);
 
 	os_start();
 }
 
+void exti0_handler(void) {
+	exti_clear_pending(0);
+	VL53L0X_dataReady(&myTOFsensor);
+}
+
 void exti9_5_handler(void) {
 	exti_clear_pending(8);
 
@@ -181,7 +186,19 @@ void exti9_5_handler(void) {
 		return;
 	last_millis = os_current_millis();
 
-	// When the pull-up button wired to pin A8 gets pulled high
-	// enqueue an aperiodic task with computation time of 1 second
-	os_enqueue_aperiodic_task(&change_main, OS_MILLIS(1));
+	// When the pull-up button wired to pin A8 gets pulled high, step the
+	// reference value through 250, 500 and 750 mm. The step is kept here and
+	// sent along with the request, so that reference_value is only ever
+	// written by the server.
+	static const uint32_t references[][2] = {{250, 91}, {500, 61}, {750, 31}};
+	static uint32_t step = 0;
+	aperiodic_task_t* change = os_reserve_aperiodic_task();
+	if (change == NULL)
+		return;
+	step = (step + 1) % (sizeof(references) / sizeof(references[0]));
+	change->entry_point = &change_main;
+	change->computation_time = OS_MILLIS(1);
+	change->payload.words[0] = references[step][0];
+	change->payload.words[1] = references[step][1];
+	os_submit_aperiodic_task(change);
 }
@@ -3,7 +3,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#include "stm32.h"
+#include "port.h"
 
 #define max(a,b) ({ \
 	__typeof__ (a) _a = (a); \
@@ -11,143 +11,890 @@
 	_a > _b ? _a : _b; \
 })
 
-#define OS_MAX_THREADS 32
+#define min(a,b) ({ \
+	__typeof__ (a) _a = (a); \
+	__typeof__ (b) _b = (b); \
+	_a < _b ? _a : _b; \
+})
+
 static thread_t* os_threads[OS_MAX_THREADS];
-static thread_t* os_thread_current;
+// Changed along with os_threads, see os_add_thread()
+static uint32_t os_threads_version;
+thread_t* os_thread_current;
 static thread_t* os_thread_next;
-static uint32_t os_ticks;
-static uint32_t os_server_inverse_bandwidth;
+static thread_t os_server_thread;
+static os_time_t os_ticks;
+// Fraction of the processor the aperiodic server may use, in 1/65536ths,
+// either fixed by os_init() or whatever the periodic threads leave
+static uint32_t os_server_bandwidth;
+static bool os_server_bandwidth_auto;
+
+// Stack Resource Policy: a job may only start if its relative deadline is
+// shorter than the system ceiling, the shortest ceiling among locked resources.
+// Jobs held back by the ceiling wait in os_ceiling_blocked, and while they do
+// no job with a later deadline may start either. With no resource locked there
+// is no ceiling, whatever the relative deadline.
+static uint32_t os_system_ceiling;
+static uint32_t os_resources_locked;
+static thread_t* os_ceiling_blocked;
+static os_time_t os_ceiling_blocked_deadline; // Earliest among them
+
+/*
+ * Thread queues
+ */
+// Binary min-heap of threads ordered by queue_key. Each thread sits in at most
+// one queue at a time, and remembers its position in queue_index so it can be
+// removed from the middle of the heap in O(log n).
+typedef struct {
+	thread_t* threads[OS_MAX_THREADS];
+	uint32_t size;
+} os_queue_t;
+
+// Threads that may run, keyed by absolute deadline
+static os_queue_t os_ready_queue;
+// Threads waiting for their activation or delay, keyed by release time
+static os_queue_t os_release_queue;
+
+static void os_queue_place(os_queue_t* queue, uint32_t index, thread_t* thread) {
+	queue->threads[index] = thread;
+	thread->queue_index = index;
+}
+
+static void os_queue_sift_up(os_queue_t* queue, uint32_t index) {
+	thread_t* thread = queue->threads[index];
+	while (index > 0) {
+		uint32_t parent = (index - 1) / 2;
+		if (queue->threads[parent]->queue_key <= thread->queue_key)
+			break;
+		os_queue_place(queue, index, queue->threads[parent]);
+		index = parent;
+	}
+	os_queue_place(queue, index, thread);
+}
+
+static void os_queue_sift_down(os_queue_t* queue, uint32_t index) {
+	thread_t* thread = queue->threads[index];
+	while (true) {
+		uint32_t child = 2 * index + 1;
+		if (child >= queue->size)
+			break;
+		if (child + 1 < queue->size && queue->threads[child + 1]->queue_key < queue->threads[child]->queue_key)
+			child++;
+		if (thread->queue_key <= queue->threads[child]->queue_key)
+			break;
+		os_queue_place(queue, index, queue->threads[child]);
+		index = child;
+	}
+	os_queue_place(queue, index, thread);
+}
+
+static void os_queue_push(os_queue_t* queue, thread_t* thread, os_time_t key) {
+	OS_ASSERT(queue->size < OS_MAX_THREADS);
+	thread->queue_key = key;
+	os_queue_place(queue, queue->size++, thread);
+	os_queue_sift_up(queue, thread->queue_index);
+}
+
+static thread_t* os_queue_peek(os_queue_t* queue) {
+	return queue->size > 0 ? queue->threads[0] : NULL;
+}
+
+static void os_queue_remove(os_queue_t* queue, thread_t* thread) {
+	uint32_t index = thread->queue_index;
+	OS_ASSERT(index < queue->size && queue->threads[index] == thread);
+	thread_t* last = queue->threads[--queue->size];
+	if (last == thread)
+		return;
+	// Move the last thread into the hole and restore the heap property,
+	// which may require moving it either up or down
+	os_queue_place(queue, index, last);
+	os_queue_sift_up(queue, index);
+	os_queue_sift_down(queue, last->queue_index);
+}
+
+// Put a thread whose activation time has been reached in the ready queue
+static void os_thread_ready(thread_t* thread) {
+	thread->absolute_deadline = thread->activation_time + thread->relative_deadline;
+	thread->state = OS_THREAD_READY;
+	os_queue_push(&os_ready_queue, thread, thread->absolute_deadline);
+}
+
+// Put a thread in the release queue until both its activation and its delay are due
+static void os_thread_sleep(thread_t* thread) {
+	thread->state = OS_THREAD_SLEEPING;
+	os_queue_push(&os_release_queue, thread, max(thread->activation_time, thread->delayed_until));
+}
+
+// Take a thread out of whichever queue it is in
+static void os_thread_unqueue(thread_t* thread) {
+	if (thread->state == OS_THREAD_READY)
+		os_queue_remove(&os_ready_queue, thread);
+	else if (thread->state == OS_THREAD_SLEEPING)
+		os_queue_remove(&os_release_queue, thread);
+	thread->state = OS_THREAD_INACTIVE;
+}
+
+// Semaphore wait lists are kept in order of absolute deadline, with threads of
+// the same deadline in FIFO order
+static void os_wait_list_insert(semaphore_t* semaphore, thread_t* thread) {
+	thread_t** link = &semaphore->waiters;
+	while (*link != NULL && (*link)->absolute_deadline <= thread->absolute_deadline)
+		link = &(*link)->list_next;
+	thread->list_next = *link;
+	*link = thread;
+	thread->semaphore = semaphore;
+}
 
-#define OS_MAX_APERIODIC_TASKS 64
+// The thread's semaphore is left set, so the thread can tell it timed out
+static void os_wait_list_remove(thread_t* thread) {
+	thread_t** link = &thread->semaphore->waiters;
+	while (*link != thread)
+		link = &(*link)->list_next;
+	*link = thread->list_next;
+}
+
+/*
+ * SysTick
+ */
+// Number of core clock cycles in a tick
+static uint32_t os_tick_cycles;
+// Number of ticks from os_ticks to the next SysTick interrupt. It is always 1,
+// except in tickless mode while the idle thread sleeps through ticks in which
+// nothing can happen.
+static uint32_t os_systick_ticks;
+// Number of ticks in the period SysTick takes from its reload value when it
+// next wraps, which is also always 1 but for the first wrap of a stretch
+static uint32_t os_systick_next;
+
+// Cycles since the tick boundary os_ticks refers to. This is also correct if
+// SysTick has already wrapped but its interrupt is still pending.
+static uint32_t os_systick_elapsed(void) {
+	uint32_t cvr = port_timer_count();
+	if (!port_timer_pending())
+		return os_systick_ticks * os_tick_cycles - cvr;
+	// The counter reached zero, read it again in case it did after the first read
+	cvr = port_timer_count();
+	return os_systick_ticks * os_tick_cycles + (cvr != 0 ? port_timer_reload() + 1 - cvr : 0);
+}
+
+/*
+ * Trace
+ */
+#if defined(OS_TRACE)
+#if !defined(OS_TRACE_BUFFER_SIZE)
+	#define OS_TRACE_BUFFER_SIZE 1024
+#endif
+_Static_assert(OS_TRACE_BUFFER_SIZE >= 8 && (OS_TRACE_BUFFER_SIZE & (OS_TRACE_BUFFER_SIZE - 1)) == 0, "the trace buffer size must be a power of two");
+
+// Ring buffer of 8-byte event records: a magic byte, the event type, a thread
+// id, an argument, and the cycle counter in little endian. Records are only
+// written by the kernel in critical sections, and sent out by the port in the
+// background. head and tail are free-running byte counters.
 static struct {
-	aperiodic_task_t tasks[OS_MAX_APERIODIC_TASKS];
-	uint32_t head;
+	uint32_t words[OS_TRACE_BUFFER_SIZE / 4];
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	volatile uint32_t sending; // Size of the transfer in progress
+	volatile uint32_t dropped;
+} os_trace_buffer;
+
+// Send everything from the tail up to the head, or up to the end of the buffer
+static void os_trace_send(void) {
+	uint32_t head = os_trace_buffer.head;
+	uint32_t tail = os_trace_buffer.tail;
+	if (os_trace_buffer.sending != 0 || head == tail)
+		return;
+	uint32_t offset = tail % OS_TRACE_BUFFER_SIZE;
+	uint32_t size = head - tail;
+	if (size > OS_TRACE_BUFFER_SIZE - offset)
+		size = OS_TRACE_BUFFER_SIZE - offset;
+	os_trace_buffer.sending = size;
+	port_trace_send((uint8_t*) os_trace_buffer.words + offset, size);
+}
+
+static void os_trace(uint8_t type, uint8_t id, uint8_t argument) {
+	uint32_t head = os_trace_buffer.head;
+	if (head - os_trace_buffer.tail > OS_TRACE_BUFFER_SIZE - 8) {
+		os_trace_buffer.dropped++;
+		return;
+	}
+	uint32_t* record = &os_trace_buffer.words[head % OS_TRACE_BUFFER_SIZE / 4];
+	record[0] = OS_TRACE_MAGIC | (type << 8) | (id << 16) | (argument << 24);
+	record[1] = port_cycles();
+	os_trace_buffer.head = head + 8;
+	os_trace_send();
+}
+
+static void os_trace_init(void) {
+	os_trace_buffer.head = 0;
+	os_trace_buffer.tail = 0;
+	os_trace_buffer.sending = 0;
+	os_trace_buffer.dropped = 0;
+}
+
+uint32_t os_trace_dropped(void) {
+	return os_trace_buffer.dropped;
+}
+
+void os_trace_sent(void) {
+	port_critical_t critical = port_enter_critical();
+	os_trace_buffer.tail += os_trace_buffer.sending;
+	os_trace_buffer.sending = 0;
+	os_trace_send();
+	port_exit_critical(critical);
+}
+
+	#define OS_TRACE_EVENT(type, id, argument) os_trace(type, id, argument)
+#else
+	#define OS_TRACE_EVENT(type, id, argument) ((void) 0)
+#endif
+
+/*
+ * Tickless mode
+ */
+#if defined(OS_TICKLESS)
+// Bring os_ticks up to date and go back to interrupting on every tick, on the
+// same tick boundaries as if SysTick had never been stretched
+static void os_tickless_resume(void) {
+	if (os_systick_ticks == 1 && os_systick_next == 1)
+		return;
+	if (port_timer_pending() && os_systick_next == 1) {
+		// The whole stretched period has elapsed and the counter went on with
+		// a regular one, account for it right now
+		port_timer_clear_pending();
+		os_ticks += os_systick_ticks;
+		os_systick_ticks = 1;
+		return;
+	}
+	// Cut the stretch short. Restarting the counter loses the cycles spent
+	// working out where the next tick boundary is, so take them off.
+	uint32_t start = port_cycles();
+	uint32_t elapsed = os_systick_elapsed();
+	os_ticks += elapsed / os_tick_cycles;
+	// Interrupt again on the next tick boundary, or on the one after it if
+	// the next one is too close to be programmed reliably
+	uint32_t remaining = os_tick_cycles - elapsed % os_tick_cycles;
+	os_systick_ticks = 1;
+	os_systick_next = 1;
+	if (remaining < 64 + port_cycles() - start) {
+		remaining += os_tick_cycles;
+		os_systick_ticks = 2;
+	}
+	port_timer_restart(remaining - (port_cycles() - start) - 1);
+	port_timer_set_reload(os_tick_cycles - 1);
+	// The elapsed cycles already count a wrap that may be pending
+	port_timer_clear_pending();
+}
+
+// Called when the idle thread is about to run: skip SysTick interrupts until
+// the next thread release, as long as the 24-bit counter can reach it. The
+// counter is left running to the next tick boundary, where it takes the long
+// period from its reload value, so that no cycle is lost.
+static void os_tickless_stretch(void) {
+	if (os_systick_ticks != 1 || os_systick_next != 1 || port_timer_count() == 0 || port_timer_pending())
+		return;
+	thread_t* thread = os_queue_peek(&os_release_queue);
+	uint32_t ticks = (PORT_TIMER_RELOAD_MAX + 1) / os_tick_cycles + 1;
+	if (thread != NULL && thread->queue_key - os_ticks < ticks)
+		ticks = thread->queue_key - os_ticks;
+	// A long period of one tick is a regular one
+	if (ticks <= 2)
+		return;
+	port_timer_set_reload((ticks - 1) * os_tick_cycles - 1);
+	os_systick_next = ticks - 1;
+}
+#endif
+
+/*
+ * Constant Bandwidth Server
+ */
+#if defined(OS_SERVER_CBS)
+#if !defined(OS_SERVER_CBS_PERIOD)
+	#define OS_SERVER_CBS_PERIOD OS_MILLIS(10)
+#endif
+
+// The server may run for os_server_max_budget ticks every OS_SERVER_CBS_PERIOD
+// ticks, that is, with a bandwidth of os_server_bandwidth.
+static uint32_t os_server_max_budget;
+static uint32_t os_server_budget;
+static os_time_t os_server_deadline;
+// Index of the aperiodic queue from which on requests arrived after the server
+// last went idle
+static uint32_t os_server_idle_index;
+
+// Called when the server gets to a request that arrived while it had nothing to do
+static void os_server_arrival(os_time_t arrival_time) {
+	// Keep the current budget and deadline if serving the request with them
+	// would not exceed the server bandwidth, otherwise start a new period
+	if (os_server_deadline > arrival_time && ((uint64_t) os_server_budget << 16) < (os_server_deadline - arrival_time) * os_server_bandwidth)
+		return;
+	os_server_budget = os_server_max_budget;
+	os_server_deadline = arrival_time + OS_SERVER_CBS_PERIOD;
+}
+
+// Called on every tick the server has run for
+static void os_server_consume(void) {
+	if (os_server_budget > 1) {
+		os_server_budget--;
+		return;
+	}
+	// The budget is exhausted: recharge it and postpone the deadline, so an
+	// overrunning request only delays itself and never the periodic threads
+	os_server_budget = os_server_max_budget;
+	os_server_deadline += OS_SERVER_CBS_PERIOD;
+	os_server_thread.activation_time += OS_SERVER_CBS_PERIOD;
+	if (os_server_thread.state == OS_THREAD_READY) {
+		os_queue_remove(&os_ready_queue, &os_server_thread);
+		os_thread_ready(&os_server_thread);
+	}
+}
+#endif
+
+/*
+ * Aperiodic requests
+ */
+// Lock-free ring of requests from interrupt handlers and threads to the server.
+// A producer claims the slot at head by moving head forward with an exclusive
+// store, but only if the slot's sequence number says it is free, that is equal
+// to head. It then fills the slot and publishes it by setting its sequence to
+// head + 1. The server serves the slot at tail once its sequence is tail + 1,
+// in place, and then frees it for the next lap by setting it to tail + the ring
+// size. head, tail and the sequence numbers are free-running counters.
+#if !defined(OS_MAX_APERIODIC_TASKS)
+	#define OS_MAX_APERIODIC_TASKS 64
+#endif
+_Static_assert((OS_MAX_APERIODIC_TASKS & (OS_MAX_APERIODIC_TASKS - 1)) == 0, "the aperiodic queue size must be a power of two");
+
+static struct {
+	struct {
+		volatile uint32_t sequence;
+		aperiodic_task_t task;
+	} slots[OS_MAX_APERIODIC_TASKS];
+	volatile uint32_t head;
 	uint32_t tail;
-} aperiodic_task_queue = {
-	.head = 0,
-	.tail = 0,
-};
+	volatile uint32_t dropped;
+	volatile uint32_t high_water;
+} os_aperiodic_queue;
 
-bool os_enqueue_aperiodic_task(void (*entry_point)(void), uint32_t computation_time) {
-	__disable_irq();
+// Absolute deadline of the previous aperiodic request, for the TBS
+static os_time_t os_server_previous_deadline;
+// Arrival time of the request the server is serving
+static os_time_t os_server_request_arrival;
 
-	// If the queue is full, return false
-	if ((aperiodic_task_queue.head + 1) % OS_MAX_APERIODIC_TASKS == aperiodic_task_queue.tail)
-		return false;
+#if defined(OS_TICKLESS)
+	// Set by a request that may have come in while the kernel slept through
+	// ticks, see os_thread_switch()
+	static volatile bool os_aperiodic_wakeup;
+#endif
 
-	aperiodic_task_t* aperiodic_task = &aperiodic_task_queue.tasks[aperiodic_task_queue.head];
-	aperiodic_task->entry_point = entry_point;
+static void os_atomic_increment(volatile uint32_t* counter) {
+	uint32_t value;
+	do {
+		value = port_load_exclusive(counter);
+	} while (!port_store_exclusive(counter, value + 1));
+}
 
-	// Calculate a new absolute deadline by the equation max(t, d_(k-1)) + C/(1-U) where
-	//   t is the current time
-	//   d_(k-1) is the absolute deadline of the previous aperiodic request
-	//   C is the aperiodic task computation time
-	//   1/(1-U) is the inverse server bandwidth
-	// Start with d_0 = 0
-	static uint32_t previous_absolute_deadline = 0;
-	aperiodic_task->absolute_deadline = max(os_ticks, previous_absolute_deadline) + computation_time * os_server_inverse_bandwidth;
-	previous_absolute_deadline = aperiodic_task->absolute_deadline;
+static void os_atomic_maximum(volatile uint32_t* maximum, uint32_t value) {
+	uint32_t current;
+	do {
+		current = port_load_exclusive(maximum);
+		if (current >= value) {
+			port_clear_exclusive();
+			return;
+		}
+	} while (!port_store_exclusive(maximum, value));
+}
 
-	aperiodic_task_queue.head = (aperiodic_task_queue.head + 1) % OS_MAX_APERIODIC_TASKS;
+static void os_aperiodic_queue_init(void) {
+	for (uint32_t i = 0; i < OS_MAX_APERIODIC_TASKS; i++)
+		os_aperiodic_queue.slots[i].sequence = i;
+	os_aperiodic_queue.head = 0;
+	os_aperiodic_queue.tail = 0;
+	os_aperiodic_queue.dropped = 0;
+	os_aperiodic_queue.high_water = 0;
+	os_server_previous_deadline = 0;
+	os_server_request_arrival = 0;
+	#if defined(OS_TICKLESS)
+		os_aperiodic_wakeup = false;
+	#endif
+}
 
-	__enable_irq();
-	return true;
+// Never masks interrupts, so unlike the rest of the kernel it may be called
+// from interrupt handlers of any priority. The request's deadline is only
+// worked out when the server gets to it, from the time it arrived.
+aperiodic_task_t* os_reserve_aperiodic_task(void) {
+	// A server the periodic threads left no bandwidth to takes no requests
+	if (os_server_bandwidth == 0) {
+		os_atomic_increment(&os_aperiodic_queue.dropped);
+		return NULL;
+	}
+	uint32_t head;
+	do {
+		head = port_load_exclusive(&os_aperiodic_queue.head);
+		// If the queue is full, return NULL
+		if (os_aperiodic_queue.slots[head % OS_MAX_APERIODIC_TASKS].sequence != head) {
+			port_clear_exclusive();
+			os_atomic_increment(&os_aperiodic_queue.dropped);
+			return NULL;
+		}
+	} while (!port_store_exclusive(&os_aperiodic_queue.head, head + 1));
+
+	aperiodic_task_t* aperiodic_task = &os_aperiodic_queue.slots[head % OS_MAX_APERIODIC_TASKS].task;
+	aperiodic_task->arrival_time = os_current_ticks();
+	aperiodic_task->completion = NULL;
+	return aperiodic_task;
 }
 
-static bool os_dequeue_aperiodic_task(aperiodic_task_t* aperiodic_task) {
-	__disable_irq();
-	// If queue is empty, return false
-	if (aperiodic_task_queue.head == aperiodic_task_queue.tail)
+void os_submit_aperiodic_task(aperiodic_task_t* aperiodic_task) {
+	OS_ASSERT(aperiodic_task && aperiodic_task->entry_point);
+	// The slot's sequence still holds the head it was claimed at
+	uint32_t index = ((uintptr_t) aperiodic_task - (uintptr_t) &os_aperiodic_queue.slots[0].task) / sizeof(os_aperiodic_queue.slots[0]);
+	uint32_t sequence = os_aperiodic_queue.slots[index].sequence;
+	port_memory_barrier();
+	os_aperiodic_queue.slots[index].sequence = sequence + 1;
+	// The tail only lags further behind, so this may overestimate but never miss the peak
+	os_atomic_maximum(&os_aperiodic_queue.high_water, sequence + 1 - os_aperiodic_queue.tail);
+
+	#if defined(OS_TICKLESS)
+		// Have PendSV stop sleeping through ticks, so the server gets
+		// activated right away rather than at the next release
+		os_aperiodic_wakeup = true;
+		port_request_switch();
+	#endif
+}
+
+bool os_enqueue_aperiodic_task(void (*entry_point)(aperiodic_task_t* aperiodic_task), uint32_t computation_time) {
+	aperiodic_task_t* aperiodic_task = os_reserve_aperiodic_task();
+	if (aperiodic_task == NULL)
 		return false;
-	*aperiodic_task = aperiodic_task_queue.tasks[aperiodic_task_queue.tail];
-	aperiodic_task_queue.tail = (aperiodic_task_queue.tail + 1) % OS_MAX_APERIODIC_TASKS;
-	__enable_irq();
+	aperiodic_task->entry_point = entry_point;
+	aperiodic_task->computation_time = computation_time;
+	os_submit_aperiodic_task(aperiodic_task);
 	return true;
 }
 
-static bool os_peek_aperiodic_task(aperiodic_task_t* aperiodic_task) {
-	// If queue is empty, return false
-	if (aperiodic_task_queue.head == aperiodic_task_queue.tail)
+// The request at the tail, or NULL if it has not been submitted yet. Only
+// called by the server, or with the server inactive.
+static aperiodic_task_t* os_aperiodic_queue_peek(void) {
+	uint32_t tail = os_aperiodic_queue.tail;
+	if (os_aperiodic_queue.slots[tail % OS_MAX_APERIODIC_TASKS].sequence != tail + 1)
+		return NULL;
+	port_memory_barrier();
+	return &os_aperiodic_queue.slots[tail % OS_MAX_APERIODIC_TASKS].task;
+}
+
+// Free the slot of the request at the tail, once it has been served
+static void os_aperiodic_queue_pop(void) {
+	uint32_t tail = os_aperiodic_queue.tail;
+	port_memory_barrier();
+	os_aperiodic_queue.slots[tail % OS_MAX_APERIODIC_TASKS].sequence = tail + OS_MAX_APERIODIC_TASKS;
+	os_aperiodic_queue.tail = tail + 1;
+}
+
+uint32_t os_aperiodic_dropped(void) {
+	return os_aperiodic_queue.dropped;
+}
+
+uint32_t os_aperiodic_high_water(void) {
+	return os_aperiodic_queue.high_water;
+}
+
+/*
+ * Statistics
+ */
+#if defined(OS_STATS)
+// The server's jobs count from the arrival of their request, as its activation
+// time is only there to set its deadline, and may even be in the future
+static uint64_t os_stats_release_micros(const thread_t* thread) {
+	os_time_t release = thread == &os_server_thread ? os_server_request_arrival : thread->activation_time;
+	return release * 1000000 / OS_TICK_RATE_HZ;
+}
+
+// Microseconds from the job's release to now
+static uint64_t os_stats_since_release(const thread_t* thread, uint64_t now) {
+	uint64_t release = os_stats_release_micros(thread);
+	return now > release ? now - release : 0;
+}
+
+static void os_stats_job_started(thread_t* thread) {
+	uint64_t jitter = os_stats_since_release(thread, os_current_micros());
+	if (jitter > thread->stats.max_release_jitter_micros)
+		thread->stats.max_release_jitter_micros = jitter;
+}
+
+static void os_stats_job_completed(thread_t* thread) {
+	os_thread_stats_t* stats = &thread->stats;
+	uint32_t cycle = port_cycles();
+	stats->job_cycles += cycle - stats->switch_cycle;
+	stats->switch_cycle = cycle;
+
+	stats->jobs++;
+	stats->total_execution_cycles += stats->job_cycles;
+	if (stats->job_cycles > stats->max_execution_cycles)
+		stats->max_execution_cycles = stats->job_cycles;
+	stats->job_cycles = 0;
+
+	uint64_t now = os_current_micros();
+	uint64_t response = os_stats_since_release(thread, now);
+	if (response > stats->max_response_micros)
+		stats->max_response_micros = response;
+	if (now > thread->absolute_deadline * 1000000 / OS_TICK_RATE_HZ)
+		stats->deadline_misses++;
+}
+
+void os_get_stats(const thread_t* thread, os_thread_stats_t* stats) {
+	OS_ASSERT(thread && stats);
+	port_critical_t critical = port_enter_critical();
+	*stats = thread->stats;
+	port_exit_critical(critical);
+}
+
+static uint8_t* os_stats_put(uint8_t* buffer, uint32_t value) {
+	for (int i = 0; i < 4; i++, value >>= 8)
+		*buffer++ = value & 0xFF;
+	return buffer;
+}
+
+// Write one little-endian record per thread: id, jobs, deadline misses,
+// maximum and average execution cycles, maximum response time and maximum
+// release jitter in microseconds. Returns the number of bytes written.
+uint32_t os_dump_stats(uint8_t* buffer, uint32_t size) {
+	OS_ASSERT(buffer);
+	uint32_t written = 0;
+	for (uint32_t i = 0; i < OS_MAX_THREADS; i++) {
+		if (os_threads[i] == NULL)
+			continue;
+		if (written + OS_STATS_RECORD_SIZE > size)
+			break;
+		os_thread_stats_t stats;
+		os_get_stats(os_threads[i], &stats);
+		uint8_t* record = &buffer[written];
+		*record++ = os_threads[i]->id;
+		record = os_stats_put(record, stats.jobs);
+		record = os_stats_put(record, stats.deadline_misses);
+		record = os_stats_put(record, stats.max_execution_cycles);
+		record = os_stats_put(record, stats.jobs > 0 ? stats.total_execution_cycles / stats.jobs : 0);
+		record = os_stats_put(record, stats.max_response_micros);
+		record = os_stats_put(record, stats.max_release_jitter_micros);
+		written += OS_STATS_RECORD_SIZE;
+	}
+	return written;
+}
+#endif
+
+/*
+ * Admission control
+ */
+// Utilizations are in 1/65536ths, rounded up, and so is the server bandwidth
+// left by the periodic threads rounded down. Intervals longer than this are
+// not analysed, so that the demand scaled by 65536 still fits in 64 bits.
+#define OS_ADMISSION_MAX_INTERVAL (1ull << 44)
+// Points of the interval checked at most by one test, to bound how long adding
+// a thread takes. A task set that needs more is rejected.
+#if !defined(OS_ADMISSION_MAX_STEPS)
+	#define OS_ADMISSION_MAX_STEPS 256
+#endif
+
+// The threads taken into account are those already added plus the candidate
+#define os_admission_for_each(thread, candidate) \
+	for (uint32_t _i = 0; _i <= OS_MAX_THREADS; _i++) \
+		if (((thread) = _i < OS_MAX_THREADS ? os_threads[_i] : (candidate)) != NULL && (thread)->computation_time > 0)
+
+// Processor demand in [0, t] of the jobs released at 0 and every period after,
+// the worst case whatever the offsets, scaled up by the server bandwidth so
+// that it can be compared to t alone
+static os_time_t os_admission_demand(const thread_t* candidate, uint32_t bandwidth, os_time_t t) {
+	const thread_t* thread;
+	os_time_t demand = 0;
+	os_admission_for_each(thread, candidate)
+		if (t >= thread->relative_deadline)
+			demand += ((t - thread->relative_deadline) / thread->period + 1) * thread->computation_time;
+	return ((demand << 16) + (65536 - bandwidth) - 1) / (65536 - bandwidth);
+}
+
+// Latest absolute deadline strictly before t, or 0 if there is none
+static os_time_t os_admission_deadline_before(const thread_t* candidate, os_time_t t) {
+	const thread_t* thread;
+	os_time_t latest = 0;
+	os_admission_for_each(thread, candidate) {
+		if (thread->relative_deadline >= t)
+			continue;
+		os_time_t deadline = (t - 1 - thread->relative_deadline) / thread->period * thread->period + thread->relative_deadline;
+		latest = max(latest, deadline);
+	}
+	return latest;
+}
+
+// Whether the threads meet every deadline under EDF with the rest of the
+// processor given to the server, by the processor demand criterion. Quick
+// Processor-demand Analysis (Zhang and Burns) walks the deadlines backwards
+// from the end of the interval, jumping straight to the demand whenever it is
+// lower, so only a handful of points are usually checked.
+static bool os_admission_test(const thread_t* candidate, uint32_t bandwidth) {
+	const thread_t* thread;
+	uint32_t utilization = 0;
+	bool implicit_deadlines = true;
+	os_time_t min_deadline = UINT32_MAX;
+	os_time_t max_deadline = 0;
+	uint64_t slack_demand = 0; // Sum of (T - D) U
+	os_admission_for_each(thread, candidate) {
+		uint32_t thread_utilization = (((uint64_t) thread->computation_time << 16) + thread->period - 1) / thread->period;
+		utilization += thread_utilization;
+		if (utilization > 65536 - bandwidth)
+			return false;
+		if (thread->relative_deadline < thread->period) {
+			implicit_deadlines = false;
+			slack_demand += (uint64_t) (thread->period - thread->relative_deadline) * thread_utilization;
+		}
+		min_deadline = min(min_deadline, thread->relative_deadline);
+		max_deadline = max(max_deadline, thread->relative_deadline);
+	}
+	// With deadlines no shorter than periods, utilization is all there is to it
+	if (implicit_deadlines)
+		return true;
+	// Otherwise the demand only needs checking until the bound L_a, which is
+	// infinite if the processor is fully used
+	if (utilization == 65536 - bandwidth)
+		return false;
+	os_time_t end = max(max_deadline, (os_time_t) (slack_demand + (65536 - bandwidth - utilization) - 1) / (65536 - bandwidth - utilization));
+	if (end > OS_ADMISSION_MAX_INTERVAL)
+		return false;
+
+	os_time_t t = os_admission_deadline_before(candidate, end);
+	for (uint32_t step = 0; step < OS_ADMISSION_MAX_STEPS; step++) {
+		os_time_t demand = os_admission_demand(candidate, bandwidth, t);
+		if (demand > t)
+			return false;
+		if (demand <= min_deadline)
+			return true;
+		t = demand < t ? demand : os_admission_deadline_before(candidate, t);
+	}
+	return false;
+}
+
+// Whether the server has requests queued, or being served, or has given out a
+// deadline that has not passed yet, all worked out from its current bandwidth
+static bool os_server_busy(void) {
+	if (os_aperiodic_queue.head != os_aperiodic_queue.tail || os_server_thread.state != OS_THREAD_INACTIVE)
+		return true;
+	#if defined(OS_SERVER_CBS)
+		return os_server_deadline > os_ticks;
+	#else
+		return os_server_previous_deadline > os_ticks;
+	#endif
+}
+
+static void os_server_set_bandwidth(uint32_t bandwidth) {
+	os_server_bandwidth = bandwidth;
+	#if defined(OS_SERVER_CBS)
+		os_server_max_budget = (uint64_t) OS_SERVER_CBS_PERIOD * bandwidth >> 16;
+		if (os_server_max_budget == 0)
+			os_server_bandwidth = 0;
+	#endif
+}
+
+// Admit a thread if the threads, with it, stay schedulable. With a fixed server
+// bandwidth the periodic threads only get the rest of the processor. Otherwise
+// the server gets the largest bandwidth they can spare, which is 1 - U_p when
+// deadlines equal periods and is searched for bit by bit when they are shorter.
+// The bandwidth the server is to get is returned through *server_bandwidth.
+static bool os_admit(const thread_t* candidate, uint32_t* server_bandwidth) {
+	*server_bandwidth = os_server_bandwidth;
+	if (candidate->computation_time == 0)
+		return true;
+	OS_ASSERT(candidate->period > 0 && candidate->relative_deadline > 0);
+	if (!os_server_bandwidth_auto)
+		return os_admission_test(candidate, os_server_bandwidth);
+	if (!os_admission_test(candidate, 0))
 		return false;
-	*aperiodic_task = aperiodic_task_queue.tasks[aperiodic_task_queue.tail];
+
+	uint32_t utilization = 0;
+	const thread_t* thread;
+	os_admission_for_each(thread, candidate)
+		utilization += (((uint64_t) thread->computation_time << 16) + thread->period - 1) / thread->period;
+	uint32_t bandwidth = 65536 - utilization;
+	if (!os_admission_test(candidate, bandwidth)) {
+		uint32_t spared = 0;
+		for (uint32_t bit = 1u << 15; bit > 0; bit >>= 1)
+			if (spared + bit < bandwidth && os_admission_test(candidate, spared + bit))
+				spared += bit;
+		bandwidth = spared;
+	}
+	*server_bandwidth = bandwidth;
 	return true;
 }
 
 static thread_t os_idle_thread;
-static uint8_t os_idle_stack[256] __attribute__ ((aligned(8)));
+static uint8_t os_idle_stack[128] __attribute__ ((aligned(8)));
 static void os_idle_main(void) {
-	while (true) {}
+	while (true)
+		port_idle();
 }
 
-static thread_t os_server_thread; 
-static uint8_t os_server_stack[256] __attribute__ ((aligned(8)));
-static void os_server_main(void) {
-	aperiodic_task_t aperiodic_task;
-	if (!os_dequeue_aperiodic_task(&aperiodic_task))
-		return;
-	aperiodic_task.entry_point();
+// Give the server the deadline of the request at the tail of the queue
+static void os_server_activate(const aperiodic_task_t* aperiodic_task) {
+	os_server_request_arrival = aperiodic_task->arrival_time;
+	OS_TRACE_EVENT(OS_TRACE_APERIODIC_ENQUEUE, os_server_thread.id, os_aperiodic_queue.head - os_aperiodic_queue.tail);
+	#if defined(OS_SERVER_CBS)
+		// The computation time is not trusted, the server deadline follows
+		// the budget actually consumed instead
+		(void) aperiodic_task;
+		// The server job is released one server period before its current
+		// deadline, which also makes that period its preemption level
+		os_server_thread.relative_deadline = OS_SERVER_CBS_PERIOD;
+		os_server_thread.activation_time = os_server_deadline - OS_SERVER_CBS_PERIOD;
+	#else
+		// Calculate the absolute deadline by the equation max(r_k, d_(k-1)) + C/U_s where
+		//   r_k is the arrival time of the request
+		//   d_(k-1) is the absolute deadline of the previous aperiodic request
+		//   C is the aperiodic task computation time
+		//   U_s is the server bandwidth, C/U_s being rounded up to stay within it
+		// Start with d_0 = 0. Requests are served in order, so working it out
+		// now gives the same deadline as on arrival.
+		OS_ASSERT(os_server_bandwidth > 0);
+		os_time_t duration = (((uint64_t) aperiodic_task->computation_time << 16) + os_server_bandwidth - 1) / os_server_bandwidth;
+		os_time_t absolute_deadline = max(aperiodic_task->arrival_time, os_server_previous_deadline) + duration;
+		os_server_previous_deadline = absolute_deadline;
+		// The deadline may already have passed after a request overran, so
+		// count it from C/U_s before it rather than from now. That is also
+		// the preemption level the request is given, the lowest there is if
+		// C/U_s does not fit in it.
+		os_server_thread.relative_deadline = min(duration, (os_time_t) UINT32_MAX);
+		os_server_thread.activation_time = absolute_deadline - os_server_thread.relative_deadline;
+	#endif
 }
 
 static void os_schedule(void) {
-	// If there is an unserved aperiodic task and the server is not active, activate it
-	aperiodic_task_t aperiodic_task;
-	if (os_peek_aperiodic_task(&aperiodic_task) && os_server_thread.activation_time == UINT32_MAX) {
-		os_server_thread.relative_deadline = aperiodic_task.absolute_deadline - os_ticks;
-		os_server_thread.activation_time = os_ticks;
+	#if defined(OS_TICKLESS)
+		os_tickless_resume();
+	#endif
+
+	// Move every thread whose release time has come to the ready queue
+	thread_t* thread;
+	while ((thread = os_queue_peek(&os_release_queue)) != NULL && thread->queue_key <= os_ticks) {
+		os_queue_remove(&os_release_queue, thread);
+		// A thread waiting on a semaphore with a timeout gives up on it
+		if (thread->semaphore != NULL)
+			os_wait_list_remove(thread);
+		os_thread_ready(thread);
+		OS_TRACE_EVENT(OS_TRACE_RELEASE, thread->id, 0);
 	}
 
-	// Find the highest-priority thread (smallest absolute deadline)
-	os_thread_next = os_threads[0];
-	uint32_t earliest_absolute_deadline = UINT32_MAX;
-	for (uint32_t i = 1; i < OS_MAX_THREADS; i++) {
-		thread_t* thread = os_threads[i];
-		if (!thread || thread->activation_time > os_ticks || thread->delayed_until > os_ticks)
-			continue;
-		uint32_t absolute_deadline = thread->activation_time + thread->relative_deadline;
-		if (absolute_deadline <= earliest_absolute_deadline) {
-			os_thread_next = thread;
-			earliest_absolute_deadline = absolute_deadline;
-		}
+	// If there is an unserved aperiodic task and the server is not active, activate it.
+	// A request that got in as the server lost all its bandwidth waits for some.
+	aperiodic_task_t* aperiodic_task;
+	if (os_server_thread.state == OS_THREAD_INACTIVE && os_server_bandwidth > 0 && (aperiodic_task = os_aperiodic_queue_peek()) != NULL) {
+		#if defined(OS_SERVER_CBS)
+			if ((int32_t) (os_aperiodic_queue.tail - os_server_idle_index) >= 0)
+				os_server_arrival(aperiodic_task->arrival_time);
+		#endif
+		os_server_activate(aperiodic_task);
+		os_thread_ready(&os_server_thread);
 	}
 
+	// The highest-priority thread (smallest absolute deadline) is at the top
+	// of the ready queue, unless it has not started yet and its preemption
+	// level is not above the system ceiling. Set such threads aside until the
+	// ceiling is lowered, along with every job not started yet whose deadline
+	// is no earlier than theirs, so that only the lock holders and the jobs
+	// they preempted run in the meantime. If there is no thread left, run the
+	// idle thread.
+	while ((os_thread_next = os_queue_peek(&os_ready_queue)) != NULL && !os_thread_next->started && ((os_resources_locked > 0 && os_thread_next->relative_deadline >= os_system_ceiling) || os_thread_next->absolute_deadline >= os_ceiling_blocked_deadline)) {
+		os_queue_remove(&os_ready_queue, os_thread_next);
+		os_thread_next->state = OS_THREAD_BLOCKED;
+		os_thread_next->list_next = os_ceiling_blocked;
+		os_ceiling_blocked = os_thread_next;
+		os_ceiling_blocked_deadline = min(os_ceiling_blocked_deadline, os_thread_next->absolute_deadline);
+	}
+	if (os_thread_next == NULL)
+		os_thread_next = &os_idle_thread;
+	#if defined(OS_TICKLESS)
+		if (os_thread_next == &os_idle_thread)
+			os_tickless_stretch();
+	#endif
+
 	// Switch to the highest-priority thread
 	if (os_thread_next != os_thread_current) {
 		// Turn on and off debugging pins
-		if (os_thread_current != NULL) {
-			#if defined(OS_DEBUG_GPIO)
-				gpio_write(GPIOA, os_thread_current->id + 2, false);
-			#endif
-			#if defined(OS_DEBUG_USART)
-				usart_write(USART1, 1);
-				usart_write(USART1, os_thread_current->id);
-			#endif
-		}
 		#if defined(OS_DEBUG_GPIO)
-			gpio_write(GPIOA, os_thread_current->id + 2, true);
-		#endif
-		#if defined(OS_DEBUG_USART)
-			usart_write(USART1, 0);
-			usart_write(USART1, os_thread_current->id);
+			if (os_thread_current != NULL)
+				port_debug_set(os_thread_current->id, false);
+			port_debug_set(os_thread_next->id, true);
 		#endif
 
-		// Force a PendSV exception
-		SCB->icsr |= SCB_ICSR_PENDSVSET;
-		asm volatile ("dsb");
+		port_request_switch();
+	} else if (!os_thread_current->started) {
+		// The running thread goes on with a new job without a switch, after
+		// overrunning its period or as the server with its next request, so
+		// the job starts right here
+		#if defined(OS_STATS)
+			os_stats_job_started(os_thread_current);
+		#endif
+		os_thread_current->started = true;
 	}
 }
 
-void os_init(uint32_t server_inverse_bandwidth) {
-	#if defined(OS_DEBUG_GPIO)
-		gpio_init(GPIOA);
+// Account for the current thread's job, which just completed
+static void os_job_completed(void) {
+	#if defined(OS_STATS)
+		os_stats_job_completed(os_thread_current);
 	#endif
-	#if defined(OS_DEBUG_USART)
-		usart_init(USART1, rcc_get_clock() / 115200);
+	if (os_ticks > os_thread_current->absolute_deadline)
+		OS_TRACE_EVENT(OS_TRACE_DEADLINE_MISS, os_thread_current->id, 0);
+}
+
+// Serves the queued requests back to back, each as a job of its own with its
+// own deadline, for as long as that deadline keeps the server at the top of
+// the ready queue. This saves the exit, restart and switch back in otherwise
+// paid for every request of a burst.
+static uint8_t os_server_stack[192] __attribute__ ((aligned(8)));
+static void os_server_main(void) {
+	aperiodic_task_t* aperiodic_task = os_aperiodic_queue_peek();
+	while (aperiodic_task != NULL) {
+		aperiodic_task->entry_point(aperiodic_task);
+		if (aperiodic_task->completion != NULL)
+			aperiodic_task->completion(aperiodic_task);
+
+		port_critical_t critical = port_enter_critical();
+		os_aperiodic_queue_pop();
+		aperiodic_task = os_aperiodic_queue_peek();
+		if (aperiodic_task != NULL) {
+			// Complete this job and release the next one in its place, which
+			// has to pass the same checks as any other job about to start
+			os_job_completed();
+			os_server_activate(aperiodic_task);
+			os_queue_remove(&os_ready_queue, &os_server_thread);
+			os_thread_ready(&os_server_thread);
+			os_server_thread.started = false;
+			os_schedule();
+		}
+		port_exit_critical(critical);
+	}
+}
+
+void os_init(uint32_t server_bandwidth) {
+	port_init();
+	#if defined(OS_TRACE)
+		os_trace_init();
 	#endif
 
-	// Set PendSV to the lowest priority
-	nvic_set_priority(IRQN_PENDSV, 0xFF);
+	// Start from scratch, so that the kernel can be run again on the host
+	for (uint32_t i = 0; i < OS_MAX_THREADS; i++)
+		os_threads[i] = NULL;
+	os_thread_current = NULL;
+	os_thread_next = NULL;
+	os_ready_queue.size = 0;
+	os_release_queue.size = 0;
+	os_ceiling_blocked = NULL;
+	os_ceiling_blocked_deadline = UINT64_MAX;
+	os_aperiodic_queue_init();
 
 	os_ticks = 0;
+	os_tick_cycles = port_clock() / OS_TICK_RATE_HZ;
+	os_systick_ticks = 1;
+	os_systick_next = 1;
+	os_system_ceiling = UINT32_MAX;
+	os_resources_locked = 0;
 
 	os_idle_thread = (thread_t) {
 		.stack_begin = &os_idle_stack[sizeof(os_idle_stack)],
@@ -156,8 +903,17 @@ void os_init(uint32_t server_inverse_bandwidth) {
 		.period = UINT32_MAX,
 	};
 	os_add_thread(&os_idle_thread);
+	// The idle thread is never queued, it runs whenever the ready queue is empty
+	os_thread_unqueue(&os_idle_thread);
 
-	os_server_inverse_bandwidth = server_inverse_bandwidth;
+	os_server_bandwidth_auto = server_bandwidth == OS_SERVER_BANDWIDTH_AUTO;
+	OS_ASSERT(os_server_bandwidth_auto || server_bandwidth <= 65536);
+	os_server_set_bandwidth(os_server_bandwidth_auto ? 65536 : server_bandwidth);
+	#if defined(OS_SERVER_CBS)
+		os_server_budget = 0;
+		os_server_deadline = 0;
+		os_server_idle_index = 0;
+	#endif
 	os_server_thread = (thread_t) {
 		.stack_begin = &os_server_stack[sizeof(os_server_stack)],
 		.entry_point = &os_server_main,
@@ -165,11 +921,39 @@ void os_init(uint32_t server_inverse_bandwidth) {
 		.period = UINT32_MAX,
 	};
 	os_add_thread(&os_server_thread);
-	os_server_thread.activation_time = UINT32_MAX;
+	// The server stays inactive until os_schedule() finds an aperiodic task for it
+	os_thread_unqueue(&os_server_thread);
 }
 
-void os_add_thread(thread_t* thread) {
+bool os_add_thread(thread_t* thread) {
 	OS_ASSERT(thread);
+	// The admission test can take long, so it runs with interrupts enabled,
+	// and again if another thread was added in the meantime
+	port_critical_t critical;
+	bool admitted;
+	uint32_t server_bandwidth;
+	while (true) {
+		uint32_t version = os_threads_version;
+		admitted = os_admit(thread, &server_bandwidth);
+		critical = port_enter_critical();
+		if (os_threads_version == version)
+			break;
+		port_exit_critical(critical);
+	}
+	if (!admitted) {
+		port_exit_critical(critical);
+		return false;
+	}
+	// The server keeps the bandwidth its requests were promised until it is
+	// done with them, so a thread that needs some of it is turned down
+	uint32_t previous_bandwidth = os_server_bandwidth;
+	os_server_set_bandwidth(server_bandwidth);
+	if (os_server_bandwidth < previous_bandwidth && os_server_busy()) {
+		os_server_set_bandwidth(previous_bandwidth);
+		port_exit_critical(critical);
+		return false;
+	}
+	os_threads_version++;
 
 	// Allocate a slot for this thread
 	for (thread->id = 0; thread->id < OS_MAX_THREADS; thread->id++)
@@ -178,62 +962,62 @@ void os_add_thread(thread_t* thread) {
 	OS_ASSERT(thread->id < OS_MAX_THREADS);
 	os_threads[thread->id] = thread;
 
-	thread->stack_pointer = (uint32_t*) thread->stack_begin;
-	*(--thread->stack_pointer) = (1 << 24); // xPSR
-	*(--thread->stack_pointer) = (uint32_t) thread->entry_point; // PC
-	*(--thread->stack_pointer) = (uint32_t) os_exit; // LR
-	*(--thread->stack_pointer) = 0x0000000C; // R12
-	*(--thread->stack_pointer) = 0x00000003; // R3
-	*(--thread->stack_pointer) = 0x00000002; // R2
-	*(--thread->stack_pointer) = 0x00000001; // R1
-	*(--thread->stack_pointer) = 0x00000000; // R0
-	*(--thread->stack_pointer) = 0x0000000B; // R11
-	*(--thread->stack_pointer) = 0x0000000A; // R10
-	*(--thread->stack_pointer) = 0x00000009; // R9
-	*(--thread->stack_pointer) = 0x00000008; // R8
-	*(--thread->stack_pointer) = 0x00000007; // R7
-	*(--thread->stack_pointer) = 0x00000006; // R6
-	*(--thread->stack_pointer) = 0x00000005; // R5
-	*(--thread->stack_pointer) = 0x00000004; // R4
-
-	thread->activation_time = os_ticks;
+	port_thread_init(thread);
+
+	thread->activation_time = os_ticks + thread->offset;
 	thread->delayed_until = os_ticks;
+	thread->started = false;
+	thread->semaphore = NULL;
+	if (thread->offset > 0)
+		os_thread_sleep(thread);
+	else
+		os_thread_ready(thread);
 
 	#if defined(OS_DEBUG_GPIO)
-		gpio_configure(GPIOA, thread->id + 2, GPIO_CR_MODE_OUTPUT_2M, GPIO_CR_CNF_OUTPUT_PUSH_PULL);
-		gpio_write(GPIOA, thread->id + 2, false);
+		port_debug_init(thread->id);
 	#endif
+
+	// A thread added at run time may preempt the current one
+	if (os_running())
+		os_schedule();
+	port_exit_critical(critical);
+	return true;
 }
 
 void os_start(void) {
-	__disable_irq();
+	port_critical_t critical = port_enter_critical();
 
-	// Initialize SysTick such that OS_SECONDS(1) is in fact equals to one second
-	// and assign it the highest priority
-	systick_init(rcc_get_clock() / OS_SECONDS(1));
-	nvic_set_priority(IRQN_SYSTICK, 0x00);
+	// Start the tick timer such that OS_SECONDS(1) is in fact equal to one second
+	port_timer_init(os_tick_cycles);
 
 	// Schedule the first thread and jump to it!
 	os_schedule();
-	__enable_irq();
+	port_exit_critical(critical);
 
 	OS_ASSERT(false);
 }
 
+// Whether threads are running, that is, whether blocking calls can be made
+bool os_running(void) {
+	return os_thread_current != NULL;
+}
+
 void os_burn(uint32_t ticks) {
-	uint32_t previous = os_ticks;
+	os_time_t previous = os_current_ticks();
 	while (ticks--) {
-		while (os_ticks == previous)
-			asm volatile ("nop");
-		previous = os_ticks;
+		while (os_current_ticks() == previous)
+			port_spin();
+		previous = os_current_ticks();
 	}
 }
 
 void os_delay(uint32_t ticks) {
-	__disable_irq();
+	port_critical_t critical = port_enter_critical();
 	os_thread_current->delayed_until = os_ticks + ticks;
+	os_thread_unqueue(os_thread_current);
+	os_thread_sleep(os_thread_current);
 	os_schedule();
-	__enable_irq();
+	port_exit_critical(critical);
 }
 
 void os_yield(void) {
@@ -241,29 +1025,57 @@ void os_yield(void) {
 }
 
 void os_exit(void) {
-	__disable_irq();
+	port_critical_t critical = port_enter_critical();
 
-	// Add the period to the activation time. If it overflows, set it to the highest possible value
-	if (__builtin_add_overflow(os_thread_current->activation_time, os_thread_current->period, &os_thread_current->activation_time))
-		os_thread_current->activation_time = UINT32_MAX;
+	os_job_completed();
+
+	// Add the period to the activation time and wait for it. The server is
+	// left inactive until os_schedule() finds another aperiodic task for it.
+	os_thread_unqueue(os_thread_current);
+	os_thread_current->started = false;
+	if (os_thread_current != &os_server_thread) {
+		os_thread_current->activation_time += os_thread_current->period;
+		os_thread_sleep(os_thread_current);
+	}
+	#if defined(OS_SERVER_CBS)
+		else
+			os_server_idle_index = os_aperiodic_queue.head;
+	#endif
 
 	// Schedule the next thread
 	os_schedule();
-	__enable_irq();
+	port_exit_critical(critical);
+
+	// Once this thread gets scheduled again, start its next job from scratch
+	port_thread_restart(os_thread_current);
+}
 
-	// Once this thread gets scheduled again, set the lr register to os_exit, and jump to the thread's entry point
-	asm volatile (
-		"  ldr lr, =os_exit\n"
-		"  ldr r1, =os_thread_current\n"
-		"  ldr r1, [r1, #0]\n"
-		"  ldr sp, [r1, #0]\n"
-		"  ldr r1, [r1, #8]\n"
-		"  bx r1\n"
-	);
+os_time_t os_current_ticks(void) {
+	// os_ticks is 64 bits wide, so read it again if SysTick updated it in
+	// between. In tickless mode it also lags behind while the idle thread
+	// sleeps, which the cycles counted by SysTick since then make up for.
+	os_time_t ticks;
+	uint32_t elapsed;
+	do {
+		ticks = os_ticks;
+		elapsed = os_systick_elapsed();
+	} while (ticks != os_ticks);
+	return ticks + elapsed / os_tick_cycles;
 }
 
+// Wraps around after about 49 days, so only use it to measure intervals
 uint32_t os_current_millis(void) {
-	return os_ticks / OS_MILLIS(1);
+	return os_current_ticks() * 1000 / OS_TICK_RATE_HZ;
+}
+
+uint64_t os_current_micros(void) {
+	os_time_t ticks;
+	uint32_t elapsed;
+	do {
+		ticks = os_ticks;
+		elapsed = os_systick_elapsed();
+	} while (ticks != os_ticks);
+	return ticks * 1000000 / OS_TICK_RATE_HZ + elapsed / (port_clock() / 1000000);
 }
 
 /*
@@ -273,114 +1085,172 @@ void semaphore_init(semaphore_t* semaphore, uint32_t maximum_value, uint32_t sta
 	OS_ASSERT(semaphore);
 	semaphore->maximum_value = maximum_value;
 	semaphore->current_value = starting_value;
+	semaphore->waiters = NULL;
 }
 
 void semaphore_wait(semaphore_t* semaphore) {
 	OS_ASSERT(semaphore);
-	__disable_irq();
-	while (semaphore->current_value == 0) {
-		os_yield();
-		__disable_irq();
+	port_critical_t critical = port_enter_critical();
+	OS_TRACE_EVENT(OS_TRACE_SEMAPHORE_WAIT, os_thread_current->id, semaphore->current_value == 0);
+	if (semaphore->current_value > 0) {
+		semaphore->current_value--;
+	} else {
+		// Block in the wait list until semaphore_signal() hands the semaphore over
+		thread_t* thread = os_thread_current;
+		os_thread_unqueue(thread);
+		thread->state = OS_THREAD_BLOCKED;
+		os_wait_list_insert(semaphore, thread);
+		os_schedule();
 	}
-	semaphore->current_value--;
-	// NOTE(Tiago): Do not enable IRQs now as part of the NPP.
-	// This means that as soon as semaphore_wait() returns, we are
-	// in a critical section.
-	// __enable_irq();
+	// If this thread blocked, PendSV switches to another one as soon as the
+	// critical section is left, and this returns once the semaphore has been
+	// handed over
+	port_exit_critical(critical);
 }
 
+bool semaphore_wait_timeout(semaphore_t* semaphore, uint32_t ticks) {
+	OS_ASSERT(semaphore);
+	port_critical_t critical = port_enter_critical();
+	OS_TRACE_EVENT(OS_TRACE_SEMAPHORE_WAIT, os_thread_current->id, semaphore->current_value == 0);
+	bool acquired = true;
+	if (semaphore->current_value > 0) {
+		semaphore->current_value--;
+	} else if (ticks == 0) {
+		acquired = false;
+	} else {
+		// Wait in both the wait list and the release queue, whichever is first
+		thread_t* thread = os_thread_current;
+		os_thread_unqueue(thread);
+		os_wait_list_insert(semaphore, thread);
+		thread->delayed_until = os_ticks + ticks;
+		os_thread_sleep(thread);
+		os_schedule();
+		port_exit_critical(critical);
+		critical = port_enter_critical();
+		// semaphore_signal() clears the semaphore when it hands it over
+		acquired = thread->semaphore == NULL;
+		thread->semaphore = NULL;
+	}
+	port_exit_critical(critical);
+	return acquired;
+}
+
+// Safe to call from interrupt handlers
 void semaphore_signal(semaphore_t* semaphore) {
 	OS_ASSERT(semaphore);
-	__disable_irq();
-	if (semaphore->current_value < semaphore->maximum_value)
+	port_critical_t critical = port_enter_critical();
+	thread_t* thread = semaphore->waiters;
+	OS_TRACE_EVENT(OS_TRACE_SEMAPHORE_SIGNAL, thread != NULL ? thread->id : os_thread_current != NULL ? os_thread_current->id : 0, thread != NULL);
+	if (thread != NULL) {
+		// Hand the semaphore straight to the earliest-deadline waiter, which
+		// preempts the current thread right away if its deadline is earlier
+		semaphore->waiters = thread->list_next;
+		thread->semaphore = NULL;
+		os_thread_unqueue(thread);
+		os_thread_ready(thread);
+		os_schedule();
+	} else if (semaphore->current_value < semaphore->maximum_value) {
 		semaphore->current_value++;
-	// NOTE(Tiago): Enable IRQs now as part of the NPP.
-	// This means that as soon as semaphore_signal() returns, we are
-	// *out* of a critical session.
-	// This *disallows* the use of nested critical sections.
-	// A simple "fix" would be to remove this call to __enable_irq()
-	// and leave this responsibility to the user.
-	__enable_irq();
+	}
+	port_exit_critical(critical);
 }
 
 /*
- * Handlers
+ * Resource
  */
-void assert_handler(const char* module, int line) {
-	(void) module, (void) line;
-
-	__disable_irq();
-
-	// Initialize the on-board LED (pin C13)
-	gpio_init(GPIOC);
-	gpio_configure(GPIOC, 13, GPIO_CR_MODE_OUTPUT_50M, GPIO_CR_CNF_OUTPUT_PUSH_PULL);
-
-	// And blink it forever
-	bool led_state = false;
-	while (true) {
-		gpio_write(GPIOC, 13, led_state = !led_state);
-		for (volatile int i = 0; i < 5e5; i++) {}
-	}
+void resource_init(resource_t* resource) {
+	OS_ASSERT(resource);
+	resource->ceiling = UINT32_MAX;
+	resource->owner = NULL;
 }
 
-void nmi_handler(void) {
-	OS_ASSERT(false);
+void resource_use(resource_t* resource, const thread_t* thread) {
+	OS_ASSERT(resource && thread);
+	if (thread->relative_deadline < resource->ceiling)
+		resource->ceiling = thread->relative_deadline;
 }
 
-void hard_fault_handler(void) {
-	OS_ASSERT(false);
+// Never blocks: under the SRP, by the time a job starts every resource it may
+// lock is free. Resources must be unlocked in the reverse order of locking,
+// and a thread must not wait on a semaphore or delay while holding one.
+void resource_lock(resource_t* resource) {
+	OS_ASSERT(resource);
+	port_critical_t critical = port_enter_critical();
+	OS_ASSERT(resource->owner == NULL);
+	resource->owner = os_thread_current;
+	resource->previous_system_ceiling = os_system_ceiling;
+	if (resource->ceiling < os_system_ceiling)
+		os_system_ceiling = resource->ceiling;
+	os_resources_locked++;
+	port_exit_critical(critical);
 }
 
-void mm_fault_handler(void) {
-	OS_ASSERT(false);
-}
+void resource_unlock(resource_t* resource) {
+	OS_ASSERT(resource);
+	port_critical_t critical = port_enter_critical();
+	OS_ASSERT(resource->owner == os_thread_current);
+	resource->owner = NULL;
+	os_system_ceiling = resource->previous_system_ceiling;
+	os_resources_locked--;
 
-void bus_fault_handler(void) {
-	OS_ASSERT(false);
+	// Give every job held back by the ceiling another chance. Those still
+	// below it are set aside again when they reach the top of the ready queue.
+	while (os_ceiling_blocked != NULL) {
+		thread_t* thread = os_ceiling_blocked;
+		os_ceiling_blocked = thread->list_next;
+		os_thread_ready(thread);
+	}
+	os_ceiling_blocked_deadline = UINT64_MAX;
+	os_schedule();
+	port_exit_critical(critical);
 }
 
-void usage_fault_handler(void) {
-	OS_ASSERT(false);
+/*
+ * Context switch
+ */
+// Called by the port once the context of the current thread is saved
+void os_thread_switch(void) {
+	#if defined(OS_TICKLESS)
+		// An aperiodic request pended this switch to make the kernel tick again
+		if (os_aperiodic_wakeup) {
+			os_aperiodic_wakeup = false;
+			os_schedule();
+		}
+	#endif
+	#if defined(OS_STATS)
+		uint32_t cycle = port_cycles();
+		if (os_thread_current != NULL)
+			os_thread_current->stats.job_cycles += cycle - os_thread_current->stats.switch_cycle;
+		os_thread_next->stats.switch_cycle = cycle;
+		if (!os_thread_next->started)
+			os_stats_job_started(os_thread_next);
+	#endif
+	if (os_thread_current != NULL)
+		OS_TRACE_EVENT(OS_TRACE_SWITCH_OUT, os_thread_current->id, 0);
+	OS_TRACE_EVENT(OS_TRACE_SWITCH_IN, os_thread_next->id, 0);
+	os_thread_current = os_thread_next;
+	os_thread_current->started = true;
 }
 
-__attribute__ ((naked))
-void pendsv_handler(void) {
-	asm volatile (
-		// __disable_irq();
-		"  cpsid i\n"
-		// if (os_thread_current != NULL) {
-		"  ldr r1, =os_thread_current\n"
-		"  ldr r1, [r1, #0]\n"
-		"  cbz r1, pendsv_restore\n"
-		//	 push registers r4 to r11
-		"  push {r4-r11}\n"
-		//	 os_thread_current->stack_pointer = sp;
-		"  ldr r1, =os_thread_current\n"
-		"  ldr r1, [r1, #0]\n"
-		"  str sp, [r1, #4]\n"
-		// }
-		"pendsv_restore:\n"
-		// sp = os_thread_next->stack_pointer;
-		"  ldr r1, =os_thread_next\n"
-		"  ldr r1, [r1, #0]\n"
-		"  ldr sp, [r1, #4]\n"
-		// os_thread_current = os_thread_next;
-		"  ldr r1, =os_thread_next\n"
-		"  ldr r1, [r1, #0]\n"
-		"  ldr r2, =os_thread_current\n"
-		"  str r1, [r2, #0]\n"
-		// pop registers r4 to r11
-		"  pop {r4-r11}\n"
-		// __enable_irq();
-		"  cpsie i\n"
-		// return;
-		"  bx lr\n"
-	);
-}
-
-void systick_handler(void) {
-	__disable_irq();
-	os_ticks++;
+// Called by the port on every tick timer interrupt
+void os_tick(void) {
+	port_critical_t critical = port_enter_critical();
+	#if defined(OS_TICKLESS)
+		os_ticks += os_systick_ticks;
+		os_systick_ticks = os_systick_next;
+		// A stretch starts, and the counter has already taken its long period.
+		// Have it take a regular one again when it wraps, without restarting it.
+		if (os_systick_next != 1) {
+			os_systick_next = 1;
+			port_timer_set_reload(os_tick_cycles - 1);
+		}
+	#else
+		os_ticks++;
+	#endif
+	#if defined(OS_SERVER_CBS)
+		if (os_thread_current == &os_server_thread)
+			os_server_consume();
+	#endif
 	os_schedule();
-	__enable_irq();
+	port_exit_critical(critical);
 }
@@ -0,0 +1,260 @@
+#include "port.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stm32.h"
+
+_Static_assert(NVIC_PRIO_BITS == 4, "PORT_KERNEL_BASEPRI assumes 4 priority bits");
+
+#define PORT_STRING(x) #x
+#define PORT_XSTRING(x) PORT_STRING(x)
+
+// Cortex-M3 port: threads run on the process stack pointer and handlers on the
+// main stack at the top of SRAM, switches happen in the PendSV exception, and
+// the tick timer is SysTick. A thread's stack only ever holds its own frames,
+// plus the 32 bytes the core stacks on an exception and the 32 bytes of r4 to
+// r11 saved by pendsv_handler(), however deeply handlers nest. Critical
+// sections raise BASEPRI to the kernel's priority, so the interrupts above it
+// are never delayed by the kernel.
+
+/*
+ * Threads
+ */
+void port_init(void) {
+	// Set PendSV to the lowest priority, and every interrupt to the kernel's
+	// so they may all call into it. Raise the ones that must not wait for the
+	// kernel after os_init().
+	nvic_set_priority(IRQN_PENDSV, 0xFF);
+	for (int32_t irqn = 0; irqn < NVIC_IRQ_COUNT; irqn++)
+		nvic_set_priority(irqn, PORT_KERNEL_PRIORITY);
+
+	#if defined(OS_STATS) || defined(OS_TRACE) || defined(OS_TICKLESS)
+		dwt_init();
+	#endif
+	#if defined(OS_DEBUG_GPIO)
+		gpio_init(GPIOA);
+	#endif
+	#if defined(OS_TRACE)
+		dma_init(DMA1);
+		usart_init(USART1, rcc_get_clock() / 115200);
+		USART1->cr3 |= USART_CR3_DMAT;
+		nvic_enable_irq(IRQN_DMA1_CHANNEL4);
+	#endif
+}
+
+// Build the frame pendsv_handler() restores, so the thread returns from the
+// exception into its entry point, and from its entry point into os_exit()
+void port_thread_init(thread_t* thread) {
+	thread->stack_pointer = (uint32_t*) thread->stack_begin;
+	*(--thread->stack_pointer) = (1 << 24); // xPSR
+	*(--thread->stack_pointer) = (uint32_t) thread->entry_point; // PC
+	*(--thread->stack_pointer) = (uint32_t) os_exit; // LR
+	*(--thread->stack_pointer) = 0x0000000C; // R12
+	*(--thread->stack_pointer) = 0x00000003; // R3
+	*(--thread->stack_pointer) = 0x00000002; // R2
+	*(--thread->stack_pointer) = 0x00000001; // R1
+	*(--thread->stack_pointer) = 0x00000000; // R0
+	*(--thread->stack_pointer) = 0x0000000B; // R11
+	*(--thread->stack_pointer) = 0x0000000A; // R10
+	*(--thread->stack_pointer) = 0x00000009; // R9
+	*(--thread->stack_pointer) = 0x00000008; // R8
+	*(--thread->stack_pointer) = 0x00000007; // R7
+	*(--thread->stack_pointer) = 0x00000006; // R6
+	*(--thread->stack_pointer) = 0x00000005; // R5
+	*(--thread->stack_pointer) = 0x00000004; // R4
+}
+
+void port_request_switch(void) {
+	// Force a PendSV exception
+	SCB->icsr |= SCB_ICSR_PENDSVSET;
+	asm volatile ("dsb");
+}
+
+// Set the lr register to os_exit, reset the process stack, and jump to the
+// entry point
+void port_thread_restart(thread_t* thread) {
+	asm volatile (
+		"  mov lr, %0\n"
+		"  msr psp, %1\n"
+		"  bx %2\n"
+		:
+		: "r" (os_exit), "r" (thread->stack_begin), "r" (thread->entry_point)
+	);
+	__builtin_unreachable();
+}
+
+void port_idle(void) {
+	// Without tickless mode, SysTick would wake the core up on every tick anyway
+	#if defined(OS_TICKLESS)
+		asm volatile ("wfi");
+	#endif
+}
+
+void port_spin(void) {
+	asm volatile ("nop");
+}
+
+/*
+ * Tick timer
+ */
+_Static_assert(PORT_TIMER_RELOAD_MAX == SYSTICK_RVR_MAX, "SysTick is 24 bits wide");
+
+void port_timer_init(uint32_t cycles) {
+	// SysTick calls into the kernel, so it cannot be above it
+	systick_init(cycles);
+	nvic_set_priority(IRQN_SYSTICK, PORT_KERNEL_PRIORITY);
+}
+
+uint32_t port_timer_count(void) {
+	return SYSTICK->cvr;
+}
+
+uint32_t port_timer_reload(void) {
+	return SYSTICK->rvr;
+}
+
+void port_timer_restart(uint32_t reload) {
+	SYSTICK->rvr = reload;
+	SYSTICK->cvr = 0;
+}
+
+void port_timer_set_reload(uint32_t reload) {
+	SYSTICK->rvr = reload;
+}
+
+bool port_timer_pending(void) {
+	return SCB->icsr & SCB_ICSR_PENDSTSET;
+}
+
+void port_timer_clear_pending(void) {
+	SCB->icsr = SCB_ICSR_PENDSTCLR;
+}
+
+/*
+ * Clock
+ */
+uint32_t port_clock(void) {
+	return rcc_get_clock();
+}
+
+uint32_t port_cycles(void) {
+	return DWT->cyccnt;
+}
+
+/*
+ * Instrumentation
+ */
+#if defined(OS_DEBUG_GPIO)
+// Thread pins start at A2
+void port_debug_init(uint8_t id) {
+	gpio_configure(GPIOA, id + 2, GPIO_CR_MODE_OUTPUT_2M, GPIO_CR_CNF_OUTPUT_PUSH_PULL);
+	gpio_write(GPIOA, id + 2, false);
+}
+
+void port_debug_set(uint8_t id, bool running) {
+	gpio_write(GPIOA, id + 2, running);
+}
+#endif
+
+#if defined(OS_TRACE)
+// DMA1 channel wired to USART1_TX
+#define PORT_TRACE_DMA_CHANNEL 4
+
+void port_trace_send(const void* data, uint32_t size) {
+	dma_start(DMA1, PORT_TRACE_DMA_CHANNEL, &USART1->dr, data, size, DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_TCIE);
+}
+
+void dma1_channel4_handler(void) {
+	dma_clear_flags(DMA1, PORT_TRACE_DMA_CHANNEL);
+	dma_stop(DMA1, PORT_TRACE_DMA_CHANNEL);
+	os_trace_sent();
+}
+#endif
+
+/*
+ * Handlers
+ */
+void assert_handler(const char* module, int line) {
+	(void) module, (void) line;
+
+	__disable_irq();
+
+	// Initialize the on-board LED (pin C13)
+	gpio_init(GPIOC);
+	gpio_configure(GPIOC, 13, GPIO_CR_MODE_OUTPUT_50M, GPIO_CR_CNF_OUTPUT_PUSH_PULL);
+
+	// And blink it forever
+	bool led_state = false;
+	while (true) {
+		gpio_write(GPIOC, 13, led_state = !led_state);
+		for (volatile int i = 0; i < 5e5; i++) {}
+	}
+}
+
+void nmi_handler(void) {
+	OS_ASSERT(false);
+}
+
+void hard_fault_handler(void) {
+	OS_ASSERT(false);
+}
+
+void mm_fault_handler(void) {
+	OS_ASSERT(false);
+}
+
+void bus_fault_handler(void) {
+	OS_ASSERT(false);
+}
+
+void usage_fault_handler(void) {
+	OS_ASSERT(false);
+}
+
+// The core has stacked r0 to r3, r12, lr, pc and xPSR on the thread's process
+// stack, and the rest of the context is saved below them
+__attribute__ ((naked))
+void pendsv_handler(void) {
+	asm volatile (
+		// Enter a critical section, PendSV only runs when there is none
+		"  movs r0, #" PORT_XSTRING(PORT_KERNEL_BASEPRI) "\n"
+		"  msr basepri, r0\n"
+		// if (os_thread_current != NULL) {
+		"  ldr r1, =os_thread_current\n"
+		"  ldr r1, [r1, #0]\n"
+		"  cbz r1, pendsv_first\n"
+		//	 push registers r4 to r11 on the process stack
+		"  mrs r0, psp\n"
+		"  stmdb r0!, {r4-r11}\n"
+		//	 os_thread_current->stack_pointer = psp;
+		"  str r0, [r1, #4]\n"
+		"  b pendsv_restore\n"
+		// } else {
+		//	 The main stack belongs to handlers from now on, drop what main() left on it
+		"pendsv_first:\n"
+		"  ldr r0, =_estack\n"
+		"  msr msp, r0\n"
+		// }
+		"pendsv_restore:\n"
+		// os_thread_switch();
+		"  bl os_thread_switch\n"
+		// psp = os_thread_current->stack_pointer;
+		"  ldr r1, =os_thread_current\n"
+		"  ldr r1, [r1, #0]\n"
+		"  ldr r0, [r1, #4]\n"
+		// pop registers r4 to r11 from the process stack
+		"  ldmia r0!, {r4-r11}\n"
+		"  msr psp, r0\n"
+		// Leave the critical section
+		"  movs r0, #0\n"
+		"  msr basepri, r0\n"
+		// return to thread mode, on the process stack
+		"  ldr lr, =0xFFFFFFFD\n"
+		"  bx lr\n"
+	);
+}
+
+void systick_handler(void) {
+	os_tick();
+}
@@ -0,0 +1,183 @@
+#include "serial.h"
+
+#include <stdbool.h>
+
+#include "miros.h"
+#include "port.h"
+#include "stm32.h"
+
+#if !defined(SERIAL_TX_BUFFER_SIZE)
+	#define SERIAL_TX_BUFFER_SIZE 256
+#endif
+#if !defined(SERIAL_RX_BUFFER_SIZE)
+	#define SERIAL_RX_BUFFER_SIZE 128
+#endif
+_Static_assert((SERIAL_TX_BUFFER_SIZE & (SERIAL_TX_BUFFER_SIZE - 1)) == 0, "the transmit buffer size must be a power of two");
+_Static_assert((SERIAL_RX_BUFFER_SIZE & (SERIAL_RX_BUFFER_SIZE - 1)) == 0, "the receive buffer size must be a power of two");
+
+// DMA1 channels wired to USART1_TX and USART1_RX
+#define SERIAL_TX_DMA_CHANNEL 4
+#define SERIAL_RX_DMA_CHANNEL 5
+
+/*
+ * Transmitter
+ */
+#if !defined(OS_TRACE)
+// head and tail are free-running byte counters. The DMA sends the contiguous
+// run starting at the tail, and the transfer complete interrupt starts the next.
+static struct {
+	uint8_t data[SERIAL_TX_BUFFER_SIZE];
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	volatile uint32_t sending; // Size of the DMA transfer in progress
+} serial_tx;
+
+static void serial_tx_send(void) {
+	uint32_t head = serial_tx.head;
+	uint32_t tail = serial_tx.tail;
+	if (serial_tx.sending != 0 || head == tail)
+		return;
+	uint32_t offset = tail % SERIAL_TX_BUFFER_SIZE;
+	uint32_t size = head - tail;
+	if (size > SERIAL_TX_BUFFER_SIZE - offset)
+		size = SERIAL_TX_BUFFER_SIZE - offset;
+	serial_tx.sending = size;
+	dma_start(DMA1, SERIAL_TX_DMA_CHANNEL, &USART1->dr, &serial_tx.data[offset], size, DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_TCIE);
+}
+
+void dma1_channel4_handler(void) {
+	port_critical_t critical = port_enter_critical();
+	dma_clear_flags(DMA1, SERIAL_TX_DMA_CHANNEL);
+	dma_stop(DMA1, SERIAL_TX_DMA_CHANNEL);
+	serial_tx.tail += serial_tx.sending;
+	serial_tx.sending = 0;
+	serial_tx_send();
+	port_exit_critical(critical);
+}
+#endif
+
+uint32_t serial_write(const void* data, uint32_t size) {
+	#if defined(OS_TRACE)
+		(void) data;
+		(void) size;
+		return 0;
+	#else
+		const uint8_t* bytes = data;
+		port_critical_t critical = port_enter_critical();
+		uint32_t head = serial_tx.head;
+		uint32_t free = SERIAL_TX_BUFFER_SIZE - (head - serial_tx.tail);
+		if (size > free)
+			size = free;
+		for (uint32_t i = 0; i < size; i++)
+			serial_tx.data[(head + i) % SERIAL_TX_BUFFER_SIZE] = bytes[i];
+		serial_tx.head = head + size;
+		serial_tx_send();
+		port_exit_critical(critical);
+		return size;
+	#endif
+}
+
+/*
+ * Receiver
+ */
+// The DMA writes into the buffer circularly on its own. Whenever the line goes
+// idle, or the DMA crosses half or the end of the buffer, the interrupt catches
+// head up with the DMA position and wakes the reader.
+static struct {
+	uint8_t data[SERIAL_RX_BUFFER_SIZE];
+	uint32_t head; // Free-running count of received bytes
+	uint32_t tail; // Free-running count of read bytes
+	uint32_t position; // Last seen DMA position in data
+	uint32_t overruns;
+	semaphore_t ready;
+} serial_rx;
+
+// Must be called in a critical section
+static void serial_rx_update(void) {
+	uint32_t position = SERIAL_RX_BUFFER_SIZE - dma_remaining(DMA1, SERIAL_RX_DMA_CHANNEL);
+	if (position == SERIAL_RX_BUFFER_SIZE)
+		position = 0;
+	serial_rx.head += (position - serial_rx.position) % SERIAL_RX_BUFFER_SIZE;
+	serial_rx.position = position;
+	if (serial_rx.head - serial_rx.tail > SERIAL_RX_BUFFER_SIZE) {
+		serial_rx.overruns += serial_rx.head - serial_rx.tail - SERIAL_RX_BUFFER_SIZE;
+		serial_rx.tail = serial_rx.head - SERIAL_RX_BUFFER_SIZE;
+	}
+}
+
+static void serial_rx_interrupt(void) {
+	port_critical_t critical = port_enter_critical();
+	uint32_t head = serial_rx.head;
+	serial_rx_update();
+	bool received = serial_rx.head != head;
+	port_exit_critical(critical);
+	if (received)
+		semaphore_signal(&serial_rx.ready);
+}
+
+void dma1_channel5_handler(void) {
+	dma_clear_flags(DMA1, SERIAL_RX_DMA_CHANNEL);
+	serial_rx_interrupt();
+}
+
+void usart1_handler(void) {
+	// Reading SR then DR clears the idle line flag
+	if (USART1->sr & USART_SR_IDLE) {
+		(void) USART1->dr;
+		serial_rx_interrupt();
+	}
+}
+
+uint32_t serial_available(void) {
+	port_critical_t critical = port_enter_critical();
+	serial_rx_update();
+	uint32_t available = serial_rx.head - serial_rx.tail;
+	port_exit_critical(critical);
+	return available;
+}
+
+uint32_t serial_read(void* data, uint32_t size) {
+	uint8_t* bytes = data;
+	uint32_t available;
+	// A signal left over from bytes that were already read only costs an extra turn
+	while ((available = serial_available()) == 0)
+		semaphore_wait(&serial_rx.ready);
+	if (size > available)
+		size = available;
+	port_critical_t critical = port_enter_critical();
+	for (uint32_t i = 0; i < size; i++)
+		bytes[i] = serial_rx.data[(serial_rx.tail + i) % SERIAL_RX_BUFFER_SIZE];
+	serial_rx.tail += size;
+	port_exit_critical(critical);
+	return size;
+}
+
+uint32_t serial_overruns(void) {
+	return serial_rx.overruns;
+}
+
+void serial_init(uint32_t baud_rate) {
+	serial_rx.head = 0;
+	serial_rx.tail = 0;
+	serial_rx.position = 0;
+	serial_rx.overruns = 0;
+	semaphore_init(&serial_rx.ready, 1, 0);
+
+	dma_init(DMA1);
+	#if !defined(OS_TRACE)
+		serial_tx.head = 0;
+		serial_tx.tail = 0;
+		serial_tx.sending = 0;
+		usart_init(USART1, rcc_get_clock() / baud_rate);
+		USART1->cr3 |= USART_CR3_DMAT;
+		nvic_enable_irq(IRQN_DMA1_CHANNEL4);
+	#else
+		// The trace has already configured USART1
+		(void) baud_rate;
+	#endif
+	dma_start(DMA1, SERIAL_RX_DMA_CHANNEL, &USART1->dr, serial_rx.data, SERIAL_RX_BUFFER_SIZE, DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_HTIE | DMA_CCR_TCIE);
+	USART1->cr3 |= USART_CR3_DMAR;
+	USART1->cr1 |= USART_CR1_IDLEIE;
+	nvic_enable_irq(IRQN_DMA1_CHANNEL5);
+	nvic_enable_irq(IRQN_USART1);
+}
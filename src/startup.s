@@ -26,27 +26,63 @@
 	.word 0				/*   3 RTC */
 	.word 0				/*   4 FLASH */
 	.word 0				/*   5 RCC */
-	.word 0				/*   6 EXTI0 */
+	.word exti0_handler		/*   6 EXTI0 */
 	.word 0				/*   7 EXTI1 */
 	.word 0				/*   8 EXTI2 */
 	.word 0				/*   9 EXTI3 */
 	.word 0				/*  10 EXTI4 */
 	.word 0				/*  11 DMA1_Channel1 */
-	.word 0				/*  12 DMA1_Channel1 */
-	.word 0				/*  13 DMA1_Channel1 */
-	.word 0				/*  14 DMA1_Channel1 */
-	.word 0				/*  15 DMA1_Channel1 */
-	.word 0				/*  16 DMA1_Channel1 */
-	.word 0				/*  17 DMA1_Channel1 */
+	.word 0				/*  12 DMA1_Channel2 */
+	.word 0				/*  13 DMA1_Channel3 */
+	.word dma1_channel4_handler	/*  14 DMA1_Channel4 */
+	.word dma1_channel5_handler	/*  15 DMA1_Channel5 */
+	.word 0				/*  16 DMA1_Channel6 */
+	.word dma1_channel7_handler	/*  17 DMA1_Channel7 */
 	.word 0				/*  18 ADC1_2 */
 	.word 0				/*  19 CAN1_TX */
 	.word 0				/*  20 CAN1_RX0 */
 	.word 0				/*  21 CAN1_RX1 */
 	.word 0				/*  22 CAN1_SCE */
 	.word exti9_5_handler		/*  23 EXTI9_5 */
+	.word 0				/*  24 TIM1_BRK */
+	.word 0				/*  25 TIM1_UP */
+	.word 0				/*  26 TIM1_TRG_COM */
+	.word 0				/*  27 TIM1_CC */
+	.word 0				/*  28 TIM2 */
+	.word 0				/*  29 TIM3 */
+	.word 0				/*  30 TIM4 */
+	.word i2c1_ev_handler		/*  31 I2C1_EV */
+	.word i2c1_er_handler		/*  32 I2C1_ER */
+	.word 0				/*  33 I2C2_EV */
+	.word 0				/*  34 I2C2_ER */
+	.word 0				/*  35 SPI1 */
+	.word 0				/*  36 SPI2 */
+	.word usart1_handler		/*  37 USART1 */
+
+/* Handlers that are only defined by some configurations */
+.weak dma1_channel4_handler
+.thumb_set dma1_channel4_handler, default_handler
+.weak dma1_channel5_handler
+.thumb_set dma1_channel5_handler, default_handler
+.weak usart1_handler
+.thumb_set usart1_handler, default_handler
+
+.type default_handler, %function
+default_handler:
+	b .
 
 .type reset_handler, %function
 reset_handler:
+	/* Copy the data segment from flash */
+	ldr r0, =_sdata
+	ldr r1, =_edata
+	ldr r2, =_sidata
+1:	cmp r0, r1
+	ittt lt
+	ldrlt r3, [r2], #4
+	strlt r3, [r0], #4
+	blt 1b
+
 	/* Clear the BSS segment */
 	ldr r0, =_sbss
 	ldr r1, =_ebss
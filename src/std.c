@@ -1,8 +1,9 @@
 #include "std.h"
 
 #include <stdarg.h>
+#include <stdbool.h>
 
-#include "stm32.h"
+#include "serial.h"
 
 /*
  * ctype.h
@@ -15,7 +16,8 @@ int std_isdigit(int c) {
  * stdio.h
  */
 int std_putc(int c) {
-	usart_write(USART1, c);
+	char byte = c;
+	serial_write(&byte, 1);
 	return (unsigned char) c;
 }
 
@@ -44,7 +46,7 @@ int std_printf(const char* restrict format, ...) {
 			written++;
 			continue;
 		}
-		char pad_char;
+		char pad_char = ' ';
 		int pad_count = 0;
 		if (std_isdigit(*format)) {
 			pad_char = *format == '0' ? '0' : ' ';
@@ -97,6 +99,23 @@ char* std_itoa(int i, char* buffer, int base) {
 /*
  * string.h
  */
+int std_memcmp(const void* s1, const void* s2, size_t n) {
+	const unsigned char* a = s1;
+	const unsigned char* b = s2;
+	for (size_t i = 0; i < n; i++) {
+		if (a[i] != b[i])
+			return a[i] - b[i];
+	}
+	return 0;
+}
+
+void* std_memset(void* s, int c, size_t n) {
+	unsigned char* p = s;
+	for (size_t i = 0; i < n; i++)
+		p[i] = c;
+	return s;
+}
+
 size_t std_strlen(const char* s) {
 	size_t len = 0;
 	while (s[len] != 0)
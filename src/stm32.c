@@ -1,5 +1,7 @@
 #include "stm32.h"
 
+#include <stddef.h>
+
 /*
  * Cortex-M3
  */
@@ -12,6 +14,7 @@ void nvic_enable_irq(IRQN irqn) {
 
 void nvic_set_priority(IRQN irqn, uint32_t priority) {
 	if (irqn >= 0) {
+		NVIC->ip[irqn] = (uint8_t)((priority << (8 - NVIC_PRIO_BITS)) & (uint32_t) 0xFF);
 	} else {
 		SCB->shp[(((uint32_t) irqn) & 0xF) - 4] = (uint8_t)((priority << (8 - NVIC_PRIO_BITS)) & (uint32_t) 0xFF);
 	}
@@ -24,9 +27,60 @@ void systick_init(uint32_t ticks) {
 	SYSTICK->csr = SYSTICK_CSR_ENABLE | SYSTICK_CSR_TICKINT | SYSTICK_CSR_CLKSOURCE;
 }
 
+// Data watchpoint and trace (DWT)
+void dwt_init(void) {
+	CORE_DEBUG->demcr |= CORE_DEBUG_DEMCR_TRCENA;
+	DWT->cyccnt = 0;
+	DWT->ctrl |= DWT_CTRL_CYCCNTENA;
+}
+
 /*
  * STM32F103
  */
+// Flash interface registers (FLASH)
+// Erasing and programming stall the CPU whenever it fetches from flash, so
+// these are meant for initialization, not for threads with deadlines.
+void flash_unlock(void) {
+	if (FLASH->cr & FLASH_CR_LOCK) {
+		FLASH->keyr = FLASH_KEY1;
+		FLASH->keyr = FLASH_KEY2;
+	}
+}
+
+void flash_lock(void) {
+	FLASH->cr |= FLASH_CR_LOCK;
+}
+
+static bool flash_wait(void) {
+	while (FLASH->sr & FLASH_SR_BSY);
+	bool ok = !(FLASH->sr & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR));
+	FLASH->sr = FLASH_SR_PGERR | FLASH_SR_WRPRTERR | FLASH_SR_EOP;
+	return ok;
+}
+
+bool flash_erase_page(uint32_t address) {
+	FLASH->cr |= FLASH_CR_PER;
+	FLASH->ar = address;
+	FLASH->cr |= FLASH_CR_STRT;
+	bool ok = flash_wait();
+	FLASH->cr &= ~FLASH_CR_PER;
+	return ok;
+}
+
+// Flash is programmed a half-word at a time, so an odd size is padded with 0xFF
+bool flash_program(uint32_t address, const void* data, uint32_t size) {
+	const uint8_t* bytes = data;
+	bool ok = true;
+	FLASH->cr |= FLASH_CR_PG;
+	for (uint32_t i = 0; ok && i < size; i += 2) {
+		uint16_t half_word = bytes[i] | (i + 1 < size ? bytes[i + 1] << 8 : 0xFF00);
+		*(volatile uint16_t*) (address + i) = half_word;
+		ok = flash_wait();
+	}
+	FLASH->cr &= ~FLASH_CR_PG;
+	return ok;
+}
+
 // Reset and clock control (RCC)
 void rcc_init(void) {
 	// Configure the clock to 72 MHz
@@ -41,6 +95,36 @@ uint32_t rcc_get_clock(void) {
 	return 72e6;
 }
 
+// Direct memory access controller (DMA)
+void dma_init(struct dma* dma) {
+	switch ((uint32_t) dma) {
+		case (uint32_t) DMA1: RCC->ahbenr |= RCC_AHBENR_DMA1EN; break;
+	}
+}
+
+// Channels are numbered from 1, like in the reference manual
+void dma_start(struct dma* dma, uint8_t channel, volatile void* peripheral, const volatile void* memory, uint16_t count, uint32_t ccr) {
+	struct dma_channel* c = &dma->channel[channel - 1];
+	c->ccr = 0;
+	dma->ifcr = DMA_ISR_GIF(channel) | DMA_ISR_TCIF(channel) | DMA_ISR_HTIF(channel) | DMA_ISR_TEIF(channel);
+	c->cpar = (uint32_t) peripheral;
+	c->cmar = (uint32_t) memory;
+	c->cndtr = count;
+	c->ccr = ccr | DMA_CCR_EN;
+}
+
+void dma_stop(struct dma* dma, uint8_t channel) {
+	dma->channel[channel - 1].ccr &= ~DMA_CCR_EN;
+}
+
+uint16_t dma_remaining(struct dma* dma, uint8_t channel) {
+	return dma->channel[channel - 1].cndtr;
+}
+
+void dma_clear_flags(struct dma* dma, uint8_t channel) {
+	dma->ifcr = DMA_ISR_GIF(channel) | DMA_ISR_TCIF(channel) | DMA_ISR_HTIF(channel) | DMA_ISR_TEIF(channel);
+}
+
 // External interrupt event controller (EXTI)
 void exti_enable(uint8_t line) {
 	EXTI->imr |= (1 << line);
@@ -145,6 +229,135 @@ void i2c_write(struct i2c* i2c, uint8_t slave_address, uint8_t* data, uint8_t si
 	(void) reg;
 }
 
+// I2C1 asynchronous transfers are driven by the event and error interrupts.
+// Data goes through DMA1 channel 6 when writing and channel 7 when reading,
+// except single byte reads, which are handled by the event interrupt.
+#define I2C1_TX_DMA_CHANNEL 6
+#define I2C1_RX_DMA_CHANNEL 7
+
+static struct i2c_transfer* i2c1_transfer;
+static bool i2c1_reading; // Whether the transfer is past its write phase
+
+static void i2c1_finish(uint8_t status) {
+	struct i2c_transfer* transfer = i2c1_transfer;
+	I2C1->cr2 &= ~(I2C_CR2_ITERREN | I2C_CR2_ITEVTEN | I2C_CR2_ITBUFEN | I2C_CR2_DMAEN | I2C_CR2_LAST);
+	dma_stop(DMA1, I2C1_TX_DMA_CHANNEL);
+	dma_stop(DMA1, I2C1_RX_DMA_CHANNEL);
+	i2c1_transfer = NULL;
+	transfer->status = status;
+	if (transfer->callback != NULL)
+		transfer->callback(transfer);
+}
+
+// Called once every written byte has been shifted out
+static void i2c1_write_done(void) {
+	I2C1->cr2 &= ~I2C_CR2_DMAEN;
+	if (i2c1_transfer->read_size > 0) {
+		i2c1_reading = true;
+		I2C1->cr1 |= I2C_CR1_START;
+	} else {
+		I2C1->cr1 |= I2C_CR1_STOP;
+		i2c1_finish(I2C_OK);
+	}
+}
+
+bool i2c_start(struct i2c* i2c, struct i2c_transfer* transfer) {
+	if (i2c != I2C1 || i2c1_transfer != NULL)
+		return false;
+	transfer->status = I2C_BUSY;
+	i2c1_transfer = transfer;
+	i2c1_reading = transfer->write_size == 0 && transfer->read_size > 0;
+	dma_init(DMA1);
+	nvic_enable_irq(IRQN_I2C1_EV);
+	nvic_enable_irq(IRQN_I2C1_ER);
+	nvic_enable_irq(IRQN_DMA1_CHANNEL7);
+	// The stop condition of the previous transfer takes a few microseconds
+	while (i2c->cr1 & I2C_CR1_STOP);
+	i2c->cr2 |= I2C_CR2_ITERREN | I2C_CR2_ITEVTEN;
+	i2c->cr1 |= I2C_CR1_START;
+	return true;
+}
+
+// Drop the transfer in progress without calling its callback, and reset the
+// peripheral in case the bus is stuck
+void i2c_abort(struct i2c* i2c) {
+	if (i2c != I2C1 || i2c1_transfer == NULL)
+		return;
+	i2c->cr2 &= ~(I2C_CR2_ITERREN | I2C_CR2_ITEVTEN | I2C_CR2_ITBUFEN | I2C_CR2_DMAEN | I2C_CR2_LAST);
+	dma_stop(DMA1, I2C1_TX_DMA_CHANNEL);
+	dma_stop(DMA1, I2C1_RX_DMA_CHANNEL);
+	i2c1_transfer = NULL;
+	i2c->cr1 |= I2C_CR1_SWRST;
+	i2c->cr1 &= ~I2C_CR1_SWRST;
+	i2c_init(i2c);
+}
+
+void i2c1_ev_handler(void) {
+	struct i2c_transfer* transfer = i2c1_transfer;
+	uint32_t sr1 = I2C1->sr1;
+	if (transfer == NULL) {
+		I2C1->cr2 &= ~(I2C_CR2_ITEVTEN | I2C_CR2_ITBUFEN);
+		return;
+	}
+	if (sr1 & I2C_SR1_SB) {
+		I2C1->dr = (transfer->slave_address << 1) | i2c1_reading;
+	} else if (sr1 & I2C_SR1_ADDR) {
+		// ADDR is cleared by reading SR1 and then SR2, so everything that must
+		// be in place before the first data byte is set up in between
+		if (!i2c1_reading && transfer->write_size > 0) {
+			dma_start(DMA1, I2C1_TX_DMA_CHANNEL, &I2C1->dr, transfer->write_data, transfer->write_size, DMA_CCR_MINC | DMA_CCR_DIR);
+			I2C1->cr2 |= I2C_CR2_DMAEN;
+			I2C1->sr2;
+		} else if (!i2c1_reading) {
+			I2C1->sr2;
+			i2c1_write_done();
+		} else if (transfer->read_size == 1) {
+			I2C1->cr1 &= ~I2C_CR1_ACK;
+			I2C1->sr2;
+			I2C1->cr1 |= I2C_CR1_STOP;
+			I2C1->cr2 |= I2C_CR2_ITBUFEN;
+		} else {
+			// The DMA makes the peripheral NACK the last byte by itself
+			I2C1->cr1 |= I2C_CR1_ACK;
+			dma_start(DMA1, I2C1_RX_DMA_CHANNEL, &I2C1->dr, transfer->read_data, transfer->read_size, DMA_CCR_MINC | DMA_CCR_TCIE);
+			I2C1->cr2 |= I2C_CR2_DMAEN | I2C_CR2_LAST;
+			I2C1->sr2;
+		}
+	} else if ((sr1 & I2C_SR1_BTF) && !i2c1_reading) {
+		if (dma_remaining(DMA1, I2C1_TX_DMA_CHANNEL) == 0)
+			i2c1_write_done();
+	} else if ((sr1 & I2C_SR1_RXNE) && i2c1_reading) {
+		transfer->read_data[0] = I2C1->dr;
+		i2c1_finish(I2C_OK);
+	}
+}
+
+void i2c1_er_handler(void) {
+	uint32_t sr1 = I2C1->sr1;
+	uint32_t errors = sr1 & (I2C_SR1_BERR | I2C_SR1_ARLO | I2C_SR1_AF | I2C_SR1_OVR | I2C_SR1_TIMEOUT);
+	I2C1->sr1 = ~errors; // The error flags are cleared by writing 0
+	if (i2c1_transfer == NULL)
+		return;
+	if (errors & I2C_SR1_ARLO) {
+		// The bus has already been released
+		i2c1_finish(I2C_ARBITRATION_LOST);
+	} else if (errors & I2C_SR1_AF) {
+		I2C1->cr1 |= I2C_CR1_STOP;
+		i2c1_finish(I2C_NACK);
+	} else if (errors) {
+		I2C1->cr1 |= I2C_CR1_STOP;
+		i2c1_finish(I2C_BUS_ERROR);
+	}
+}
+
+void dma1_channel7_handler(void) {
+	dma_clear_flags(DMA1, I2C1_RX_DMA_CHANNEL);
+	if (i2c1_transfer == NULL)
+		return;
+	I2C1->cr1 |= I2C_CR1_STOP;
+	i2c1_finish(I2C_OK);
+}
+
 // Timer
 void timer_init(struct timer* timer) {
 	switch ((uint32_t) timer) {
@@ -6,13 +6,18 @@ import matplotlib.ticker as ticker
 import matplotlib.widgets as widgets
 import serial
 import threading
-import time
+
+CLOCK_HZ = 72000000
+MAGIC = 0xA5
+SWITCH_IN, SWITCH_OUT, RELEASE, DEADLINE_MISS, APERIODIC_ENQUEUE, SEMAPHORE_WAIT, SEMAPHORE_SIGNAL = range(7)
 
 class Traced:
 	def __init__(self, name: str):
 		self.name = name
 		self.executing = False
 		self.data = []
+		self.releases = []
+		self.misses = []
 
 class Acquirer(threading.Thread):
 	def __init__(self, traceds: list[Traced], anim: animation.FuncAnimation) -> None:
@@ -29,29 +34,51 @@ class Acquirer(threading.Thread):
 		)
 		self.stopped = True
 		self.done = False
-		self.start_time = 0
+		self.start_cycles = None
+		self.last_cycles = 0
+		self.cycles = 0
+		self.now = 0
+
+	# Read one 8-byte record, resynchronizing on the magic byte
+	def read_record(self) -> bytes:
+		data = self.serial_port.read(8)
+		while len(data) == 8 and data[0] != MAGIC:
+			index = data.find(MAGIC, 1)
+			data = data[index:] if index > 0 else b""
+			data += self.serial_port.read(8 - len(data))
+		return data
+
+	# Timestamps are the 32-bit cycle counter, which wraps every minute at 72 MHz
+	def timestamp(self, cycles: int) -> float:
+		if self.start_cycles is None:
+			self.start_cycles = cycles
+			self.last_cycles = cycles
+		self.cycles += (cycles - self.last_cycles) & 0xFFFFFFFF
+		self.last_cycles = cycles
+		return self.cycles / CLOCK_HZ
 
 	def run(self) -> None:
 		while not self.done:
-			data = self.serial_port.read(2)
-			if self.stopped or len(data) < 2:
-				continue
-			event = int(data[0])
-			if event > 1:
-				self.serial_port.read(1)
+			data = self.read_record()
+			if self.stopped or len(data) < 8:
 				continue
-			index = int(data[1])
-			if index > len(traceds):
-				self.serial_port.read(1)
+			event, index, argument = data[1], data[2], data[3]
+			if index >= len(self.traceds):
 				continue
-			traced = traceds[index]
-			if event == 0:
+			self.now = self.timestamp(int.from_bytes(data[4:8], "little"))
+			traced = self.traceds[index]
+			if event == SWITCH_IN:
 				traced.executing = True
-				if self.start_time == 0:
-					self.start_time = time.time()
-				traced.data.append((time.time() - self.start_time, 0))
-			elif event == 1:
+				traced.data.append((self.now, 0))
+			elif event == SWITCH_OUT:
+				if traced.executing:
+					enter_time = traced.data[-1][0]
+					traced.data[-1] = (enter_time, self.now - enter_time)
 				traced.executing = False
+			elif event == RELEASE:
+				traced.releases.append(self.now)
+			elif event == DEADLINE_MISS:
+				traced.misses.append(self.now)
 
 	def pause(self, event=None) -> None:
 		self.anim.pause()
@@ -61,7 +88,11 @@ class Acquirer(threading.Thread):
 		for traced in self.traceds:
 			traced.executing = False
 			traced.data.clear()
-		self.start_time = 0
+			traced.releases.clear()
+			traced.misses.clear()
+		self.start_cycles = None
+		self.cycles = 0
+		self.now = 0
 		self.anim.resume()
 		self.stopped = False
 
@@ -77,8 +108,10 @@ def animate(_):
 			continue
 		if traced.executing:
 			enter_time = traced.data[-1][0]
-			traced.data[-1] = (enter_time, time.time() - acquirer.start_time - enter_time)
+			traced.data[-1] = (enter_time, acquirer.now - enter_time)
 		ax.broken_barh(traced.data, (-index, -1), color=cmap[index])
+		ax.plot(traced.releases, [-index - 0.1] * len(traced.releases), "^", color="black")
+		ax.plot(traced.misses, [-index - 0.5] * len(traced.misses), "x", color="red")
 	ax.set_yticks(range(-(len(traceds) + 1), 0), labels=[""] * (len(traceds) + 1), minor=False)
 	ax.set_yticks([-(x + 0.5) for x in range(len(traceds))], labels=[traced.name for traced in traceds], minor=True)
 	ax.xaxis.set_major_locator(ticker.MultipleLocator(base=1.0))